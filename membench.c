@@ -0,0 +1,444 @@
+/**
+ *  @file   membench.c
+ *
+ *  @brief  Comparative benchmark of MemAlloc/MemFree and of the system malloc
+ *
+ *  @note   Runs the same synthetic workloads, with the same sequence of sizes,
+ *          against both allocators and writes one CSV line for each:
+ *              policy,allocator,workload,threads,ops,seconds,mops,p50,p90,p99,max,failed
+ *          Percentiles are cycles (nanoseconds when there is no cycle counter)
+ *          of single MemAlloc or MemFree calls.
+ *
+ *  @note   Workloads:
+ *              random      random allocations and frees in a set of slots
+ *              lifo        allocates a batch and frees it in reverse order
+ *              fifo        allocates a batch and frees it in the same order
+ *              mixed       short lived blocks among long lived ones
+ *              prodcons    one thread allocates, another one frees
+ *              threads     random in each thread, each with its own region
+ *              larson      threads replace random blocks, and pass their blocks
+ *                          to the next thread after each round
+ *          The last three need MEM_THREADS for MemAlloc.
+ *
+ *  @note   The malloc rows measure the allocator linked or preloaded, so other
+ *          allocators can be compared with LD_PRELOAD.
+ *
+ *  @note   Usage: membench [-H] [-a mem|malloc|both] [-p policy] [-n ops] [-t threads]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memmanager.h"
+
+#if defined(MEM_THREADS) || defined(MEM_THREADCACHE) || defined(MEM_REMOTEFREE)
+#define BENCHTHREADS    1
+#endif
+
+/// Regions used by MemAlloc. Thread i allocates from region i%BENCHREGIONS
+#define BENCHREGIONS    4
+#define REGIONSIZE      (64*1024*1024)
+
+#define SLOTS           1024
+#define BATCH           256
+#define MAXTHREADS      16
+#define RINGSIZE        1024
+
+/**
+ *  @brief  Allocator under test
+ */
+typedef struct allocator {
+    const char  *name;
+    void      *(*alloc)(size_t nb, uint32_t region);
+    void       (*free)(void *p);
+} ALLOCATOR;
+
+static void *SysAlloc(size_t nb, uint32_t region) {
+
+    (void) region;
+    return malloc(nb);
+}
+
+static void SysFree(void *p) {
+
+    free(p);
+}
+
+static const ALLOCATOR Allocators[] = {
+    { "mem",    MemAlloc, MemFree },
+    { "malloc", SysAlloc, SysFree },
+};
+
+static uint64_t Cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+#endif
+}
+
+static double Seconds(void) {
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+/// xorshift generator, so both allocators see the same sizes
+static uint32_t Random(uint64_t *s) {
+
+    *s ^= *s<<13;
+    *s ^= *s>>7;
+    *s ^= *s<<17;
+    return (uint32_t) (*s>>32);
+}
+
+/// Mostly small sizes with some large ones
+static size_t RandomSize(uint64_t *s) {
+
+    return 8+Random(s)%(Random(s)%16?128:4096);
+}
+
+/**
+ *  @brief  State of a thread running a workload
+ */
+typedef struct worker {
+    const ALLOCATOR *a;
+    uint32_t     index;                 ///< Thread number
+    uint32_t     nthreads;
+    size_t       ops;                   ///< Operations to do
+    uint64_t     seed;
+    uint64_t    *cycles;                ///< Cycles of each operation
+    size_t       n;                     ///< Operations done
+    size_t       failed;                ///< Allocations that returned NULL
+    void       **slot;                  ///< Blocks of the thread (larson)
+} WORKER;
+
+static void *Alloc(WORKER *w, size_t nb) {
+uint64_t t;
+void *p;
+
+    t = Cycles();
+    p = w->a->alloc(nb,w->index%BENCHREGIONS);
+    w->cycles[w->n++] = Cycles()-t;
+    if( !p )
+        w->failed++;
+    else
+        *(char *)p = 1;
+    return p;
+}
+
+static void Free(WORKER *w, void *p) {
+uint64_t t;
+
+    t = Cycles();
+    w->a->free(p);
+    w->cycles[w->n++] = Cycles()-t;
+}
+
+static void Random1(WORKER *w) {
+void *slot[SLOTS];
+uint32_t k;
+
+    memset(slot,0,sizeof(slot));
+    while( w->n < w->ops ) {
+        k = Random(&w->seed)%SLOTS;
+        if( slot[k] ) {
+            Free(w,slot[k]);
+            slot[k] = NULL;
+        } else {
+            slot[k] = Alloc(w,RandomSize(&w->seed));
+        }
+    }
+    for(k=0;k<SLOTS;k++)
+        w->a->free(slot[k]);
+}
+
+static void Lifo(WORKER *w) {
+void *batch[BATCH];
+int32_t i;
+
+    while( w->n+2*BATCH <= w->ops ) {
+        for(i=0;i<BATCH;i++)
+            batch[i] = Alloc(w,RandomSize(&w->seed));
+        for(i=BATCH-1;i>=0;i--)
+            Free(w,batch[i]);
+    }
+}
+
+static void Fifo(WORKER *w) {
+void *batch[BATCH];
+int32_t i;
+
+    while( w->n+2*BATCH <= w->ops ) {
+        for(i=0;i<BATCH;i++)
+            batch[i] = Alloc(w,RandomSize(&w->seed));
+        for(i=0;i<BATCH;i++)
+            Free(w,batch[i]);
+    }
+}
+
+/// One block in 16 lives until the end, the others are freed soon
+static void Mixed(WORKER *w) {
+void *slot[64];
+void **kept;
+size_t nkept = 0, i;
+uint32_t k;
+
+    kept = malloc(w->ops*sizeof(void *));
+    memset(slot,0,sizeof(slot));
+    while( w->n+2 <= w->ops ) {
+        k = Random(&w->seed)%64;
+        if( slot[k] ) {
+            Free(w,slot[k]);
+            slot[k] = NULL;
+        } else if( Random(&w->seed)%16 == 0 ) {
+            kept[nkept++] = Alloc(w,RandomSize(&w->seed));
+        } else {
+            slot[k] = Alloc(w,RandomSize(&w->seed));
+        }
+    }
+    for(k=0;k<64;k++)
+        w->a->free(slot[k]);
+    for(i=0;i<nkept;i++)
+        w->a->free(kept[i]);
+    free(kept);
+}
+
+/**
+ *  @brief  Ring between the producer and the consumer
+ */
+///@{
+static void *Ring[RINGSIZE];
+static atomic_size_t RingHead, RingTail;
+///@}
+
+static void *Producer(void *arg) {
+WORKER *w = arg;
+size_t head;
+void *p;
+
+    while( w->n < w->ops ) {
+        p = Alloc(w,RandomSize(&w->seed));
+        head = atomic_load_explicit(&RingHead,memory_order_relaxed);
+        while( head-atomic_load_explicit(&RingTail,memory_order_acquire) >= RINGSIZE )
+            sched_yield();
+        Ring[head%RINGSIZE] = p;
+        atomic_store_explicit(&RingHead,head+1,memory_order_release);
+    }
+    return NULL;
+}
+
+static void *Consumer(void *arg) {
+WORKER *w = arg;
+size_t tail;
+
+    while( w->n < w->ops ) {
+        tail = atomic_load_explicit(&RingTail,memory_order_relaxed);
+        while( atomic_load_explicit(&RingHead,memory_order_acquire) == tail )
+            sched_yield();
+        Free(w,Ring[tail%RINGSIZE]);
+        atomic_store_explicit(&RingTail,tail+1,memory_order_release);
+    }
+    MemFlushCache();
+    return NULL;
+}
+
+/**
+ *  @brief  Larson like workload
+ */
+///@{
+#define LARSONROUNDS    8
+
+static pthread_barrier_t LarsonBarrier;
+static WORKER *LarsonWorkers;
+
+static void *Larson(void *arg) {
+WORKER *w = arg;
+uint32_t round, k;
+size_t end;
+void **mine;
+
+    /* Not timed, as cycles has room for ops only */
+    for(k=0;k<SLOTS;k++)
+        w->slot[k] = w->a->alloc(RandomSize(&w->seed),w->index%BENCHREGIONS);
+    for(round=0;round<LARSONROUNDS;round++) {
+        end = w->ops*(round+1)/LARSONROUNDS;
+        while( w->n+2 <= end ) {
+            k = Random(&w->seed)%SLOTS;
+            Free(w,w->slot[k]);
+            w->slot[k] = Alloc(w,RandomSize(&w->seed));
+        }
+        /* Take the blocks of the previous thread */
+        pthread_barrier_wait(&LarsonBarrier);
+        mine = LarsonWorkers[(w->index+w->nthreads-1)%w->nthreads].slot;
+        pthread_barrier_wait(&LarsonBarrier);
+        w->slot = mine;
+        pthread_barrier_wait(&LarsonBarrier);
+    }
+    for(k=0;k<SLOTS;k++)
+        w->a->free(w->slot[k]);
+    MemFlushCache();
+    return NULL;
+}
+///@}
+
+static void *Run1(void *arg) {
+
+    Random1(arg);
+    MemFlushCache();
+    return NULL;
+}
+
+static int CompareCycles(const void *a, const void *b) {
+uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ *  @brief  Run a workload and write its CSV line
+ */
+static void Bench(const char *policy, const ALLOCATOR *a, const char *workload,
+                  uint32_t nthreads, size_t ops) {
+WORKER w[MAXTHREADS];
+pthread_t tid[MAXTHREADS];
+uint64_t *all;
+size_t n = 0, failed = 0, k;
+double t;
+uint32_t i;
+
+    if( nthreads == 0 )
+        nthreads = 1;
+    if( nthreads > MAXTHREADS )
+        nthreads = MAXTHREADS;
+    for(i=0;i<nthreads;i++) {
+        w[i].a = a;
+        w[i].index = i;
+        w[i].nthreads = nthreads;
+        w[i].ops = ops/nthreads;
+        w[i].seed = 88172645463325252ULL+i;
+        w[i].cycles = malloc(w[i].ops*sizeof(uint64_t));
+        w[i].n = 0;
+        w[i].failed = 0;
+        w[i].slot = malloc(SLOTS*sizeof(void *));
+    }
+
+    t = Seconds();
+    if( !strcmp(workload,"random") ) {
+        Random1(&w[0]);
+    } else if( !strcmp(workload,"lifo") ) {
+        Lifo(&w[0]);
+    } else if( !strcmp(workload,"fifo") ) {
+        Fifo(&w[0]);
+    } else if( !strcmp(workload,"mixed") ) {
+        Mixed(&w[0]);
+    } else if( !strcmp(workload,"prodcons") ) {
+        atomic_store(&RingHead,0);
+        atomic_store(&RingTail,0);
+        pthread_create(&tid[0],NULL,Producer,&w[0]);
+        pthread_create(&tid[1],NULL,Consumer,&w[1]);
+        pthread_join(tid[0],NULL);
+        pthread_join(tid[1],NULL);
+    } else if( !strcmp(workload,"larson") ) {
+        LarsonWorkers = w;
+        pthread_barrier_init(&LarsonBarrier,NULL,nthreads);
+        for(i=0;i<nthreads;i++)
+            pthread_create(&tid[i],NULL,Larson,&w[i]);
+        for(i=0;i<nthreads;i++)
+            pthread_join(tid[i],NULL);
+        pthread_barrier_destroy(&LarsonBarrier);
+    } else if( !strcmp(workload,"threads") ) {
+        for(i=0;i<nthreads;i++)
+            pthread_create(&tid[i],NULL,Run1,&w[i]);
+        for(i=0;i<nthreads;i++)
+            pthread_join(tid[i],NULL);
+    }
+    t = Seconds()-t;
+    MemFlushCache();
+
+    for(i=0;i<nthreads;i++)
+        n += w[i].n;
+    all = malloc((n+1)*sizeof(uint64_t));
+    for(i=0,n=0;i<nthreads;i++) {
+        for(k=0;k<w[i].n;k++)
+            all[n++] = w[i].cycles[k];
+        failed += w[i].failed;
+        free(w[i].cycles);
+        free(w[i].slot);
+    }
+    qsort(all,n,sizeof(uint64_t),CompareCycles);
+    if( n == 0 )
+        all[0] = 0;
+    printf("%s,%s,%s,%u,%zu,%.6f,%.3f,%llu,%llu,%llu,%llu,%zu\n",
+            policy,a->name,workload,nthreads,n,t,t>0?n/t*1e-6:0.0,
+            (unsigned long long) all[n/2],(unsigned long long) all[n*9/10],
+            (unsigned long long) all[n*99/100],(unsigned long long) all[n?n-1:0],failed);
+    fflush(stdout);
+    free(all);
+}
+
+int main(int argc, char *argv[]) {
+const char *policy = "default", *which = "both";
+size_t ops = 1000000;
+uint32_t nthreads = 4, i, r;
+int c, threads;
+
+    while( (c = getopt(argc,argv,"Ha:p:n:t:")) != -1 ) {
+        switch( c ) {
+        case 'H':
+            printf("policy,allocator,workload,threads,ops,seconds,mops,p50,p90,p99,max,failed\n");
+            break;
+        case 'a':
+            which = optarg;
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'n':
+            ops = strtoull(optarg,NULL,0);
+            break;
+        case 't':
+            nthreads = strtoul(optarg,NULL,0);
+            break;
+        default:
+            fprintf(stderr,"Usage: %s [-H] [-a mem|malloc|both] [-p policy] [-n ops] [-t threads]\n",argv[0]);
+            return 1;
+        }
+    }
+
+    for(r=0;r<BENCHREGIONS;r++)
+        MemAddRegion(r,malloc(REGIONSIZE),REGIONSIZE);
+
+    for(i=0;i<sizeof(Allocators)/sizeof(ALLOCATOR);i++) {
+        if( strcmp(which,"both") && strcmp(which,Allocators[i].name) )
+            continue;
+        threads = i > 0;
+#ifdef BENCHTHREADS
+        threads = 1;
+#endif
+        Bench(policy,&Allocators[i],"random",1,ops);
+        Bench(policy,&Allocators[i],"lifo",1,ops);
+        Bench(policy,&Allocators[i],"fifo",1,ops);
+        Bench(policy,&Allocators[i],"mixed",1,ops);
+        if( !threads )
+            continue;
+        Bench(policy,&Allocators[i],"prodcons",2,ops);
+        Bench(policy,&Allocators[i],"threads",nthreads,ops);
+        Bench(policy,&Allocators[i],"larson",nthreads,ops);
+    }
+    return 0;
+}
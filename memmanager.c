@@ -18,8 +18,53 @@
  *          All static variables are now initialized
  *          Add regions for allocation
  *
- *  @note   Header could be smaller for used blocks because the next pointer is only
- *          used for free blocks.
+ *  @note   Used blocks only have a 32 bit header. The links of the free list are
+ *          stored in the area of free blocks. Sizes are multiples of MEM_UNIT.
+ *          With MEM_HEADER64 the header is a 64 bit word, so regions can be
+ *          larger than 2 GBytes and there can be up to 256 of them.
+ *
+ *  @note   Free list organization is chosen at compile time:
+ *              default         single free list in crescent order of address (first fit)
+ *              MEM_SEGREGATED  one free list for each power of two size class and a
+ *                              bitmap of non empty lists (good fit)
+ *              MEM_TLSF        Two-Level Segregated Fit: each power of two class is
+ *                              divided in linear classes, found with two bit scans.
+ *                              Blocks are combined using boundary tags.
+ *              MEM_NEXTFIT     single free list in order of address, searched from
+ *                              where the last search stopped (next fit)
+ *              MEM_BESTFIT     tree of free blocks ordered by size and address, so the
+ *                              smallest block that fits is found (best fit).
+ *                              Blocks are combined using boundary tags.
+ *          MEM_BOUNDARYTAGS adds boundary tags to the other organizations.
+ *
+ *  @note   With MEM_BUDDY, MemAddRegionType can also add buddy regions, where
+ *          all blocks have 2^k units and are split and combined with their
+ *          buddies. Their blocks have no header, and MemFree finds them by
+ *          their address.
+ *
+ *  @note   With MEM_BITMAP, MemAddRegionType can also add bitmap regions, where
+ *          free blocks are not linked but found as runs of clear bits in a
+ *          bitmap of units.
+ *
+ *  @note   With MEM_SLAB, a region can also have slabs of objects without
+ *          header. MemAlloc takes requests up to MEM_SLAB_MAX bytes from them,
+ *          and MemFree finds them by their address.
+ *
+ *  @note   With MEM_THREADS, each region is protected by its own lock
+ *
+ *  @note   With MEM_THREADCACHE, each thread caches small freed blocks
+ *
+ *  @note   With MEM_REMOTEFREE, blocks freed by a thread that is not the last
+ *          one to allocate from the region are queued without locking
+ *
+ *  @note   With MEM_GROWABLE (Linux), a region can reserve a large address range
+ *          and commit memory to it as MemAlloc needs
+ *
+ *  @note   With MEM_TRIM (Linux), MemTrim returns the pages of free blocks to
+ *          the system. MEM_TRIM_THRESHOLD calls it from MemFree.
+ *
+ *  @note   With MEM_INSTRUMENT, histograms of request sizes and of the cycles
+ *          of MemAlloc and MemFree are kept for each region
  *
  *  @author Les Aldridge, Travis I. Seay (original version)
  *
@@ -46,41 +91,360 @@
 #include <stdio.h>
 #endif
 
+/**
+ *  @brief  Free list organization
+ *
+ *  @note   MEM_SEGREGATED and MEM_TLSF share the size class lists (bins).
+ *          TLSF needs boundary tags to combine blocks in constant time.
+ *          MEM_BESTFIT replaces the lists by a tree with the same interface
+ *          and, as it has no list to walk, needs boundary tags too.
+ *
+ *  @note   MEM_BOUNDARYTAGS can be defined for the other organizations. Then
+ *          MemFree finds the neighbours of a block without walking the list.
+ *
+ *  @note   MEM_NEXTFIT changes only where the single free list is searched from.
+ */
+///@{
+#if defined(MEM_SEGREGATED) + defined(MEM_TLSF) + defined(MEM_BESTFIT) > 1
+#error "Only one of MEM_SEGREGATED, MEM_TLSF and MEM_BESTFIT can be defined"
+#endif
+#if defined(MEM_SEGREGATED) || defined(MEM_TLSF) || defined(MEM_BESTFIT)
+#define MEM_BINS
+#endif
+#if defined(MEM_NEXTFIT) && defined(MEM_BINS)
+#error "MEM_NEXTFIT uses the single free list"
+#endif
+#if (defined(MEM_TLSF) || defined(MEM_BESTFIT)) && !defined(MEM_BOUNDARYTAGS)
+#define MEM_BOUNDARYTAGS
+#endif
+#if (defined(MEM_THREADCACHE) || defined(MEM_REMOTEFREE)) && !defined(MEM_THREADS)
+#define MEM_THREADS
+#endif
+#if defined(MEM_TRIM_THRESHOLD) && !defined(MEM_TRIM)
+#define MEM_TRIM
+#endif
+///@}
+
 /**
  *  @brief  header structure for each block
  *
- *  @note   next points to the next free block, otherwise it is NULL
+ *  @note   Only the header word is kept in used blocks. The links of the free
+ *          list (FREELINK) are stored in the area of free blocks.
  *
  *  @note   Using bit fields. It will later be used in an embedded system
  *
- *  @note   Assumed unsigned it is 32 bits long
+ *  @note   By default, the header is 32 bits long, with 2 bits for the region
+ *          (4 regions) and 28 bits for the size. With MEM_HEADER64, it is 64
+ *          bits long, with MEM_REGIONBITS bits for the region (default 8) and
+ *          the rest for the size.
+ *
+ *  @note   prevfree is only maintained with boundary tags. Then the size of a
+ *          free block is also stored in its last word (footer).
+ *
+ *  @note   With MEM_INSTRUMENT, the slack bit takes one bit of the size. It is
+ *          only meaningful in used blocks (see BlockRequest).
  */
+#ifdef MEM_HEADER64
+typedef uint64_t HWORD;                 ///< Header word and sizes in units
+#ifndef MEM_REGIONBITS
+#define MEM_REGIONBITS  8
+#endif
+#ifndef MEM_NREGIONS
+#define MEM_NREGIONS    16
+#endif
+#else
+typedef uint32_t HWORD;                 ///< Header word and sizes in units
+#define MEM_REGIONBITS  2
+#ifndef MEM_NREGIONS
+#define MEM_NREGIONS    4
+#endif
+#endif
+
+/// Number of flag bits of the header
+#ifdef MEM_INSTRUMENT
+#define MEM_FLAGBITS    3
+#else
+#define MEM_FLAGBITS    2
+#endif
+
+/// Number of bits of the size field
+#define MEM_SIZEBITS    ((int)(8*sizeof(HWORD))-MEM_REGIONBITS-MEM_FLAGBITS)
+
+#if MEM_NREGIONS > (1<<MEM_REGIONBITS)
+#error "MEM_NREGIONS does not fit in the region field of HEADER"
+#endif
+
 typedef struct header {
     union {
-        uint32_t    word;
+        HWORD       word;
         struct {
-            uint32_t    used:1;         ///< 1 bit for used/free flag
-            uint32_t    region:2;       ///< 2 bits for region
-            uint32_t    size:29;        ///< 29 bits for size (=512 MBytes)
+            HWORD       used:1;         ///< 1 bit for used/free flag
+            HWORD       prevfree:1;     ///< 1 bit set when the previous block is free
+#ifdef MEM_INSTRUMENT
+            HWORD       slack:1;        ///< 1 bit set when the end of the block holds its slack
+#endif
+            HWORD       region:MEM_REGIONBITS;  ///< Region
+            HWORD       size:8*sizeof(HWORD)-MEM_REGIONBITS-MEM_FLAGBITS;  ///< Size in units
         };
     };
-    union {
-        struct header  *next;           ///< Next free block
-        uint32_t        area[1];        ///< Place marker
-    };
 } HEADER;
 
+/// Largest size of a block in units
+#define MAXUNITS        ((((HWORD)1)<<MEM_SIZEBITS)-1)
+
+/**
+ *  @brief  Links of a free block
+ *
+ *  @note   prev is only used for size class lists and for boundary tags
+ */
+typedef struct freelink {
+    HEADER     *next;                   ///< Next free block
+    HEADER     *prev;                   ///< Previous free block
+} FREELINK;
+
+/**
+ *  @brief  Allocation unit
+ *
+ *  @note   Sizes are rounded to a multiple of MEM_UNIT bytes. The area of a block
+ *          is aligned to MEM_UNIT, so the header is just before a MEM_UNIT
+ *          boundary. MEM_UNIT must be a power of two and at least sizeof(void *).
+ */
+#ifndef MEM_UNIT
+#define MEM_UNIT        8
+#endif
+
+/**
+ *  @brief  Access to blocks
+ *
+ *  @note   BLOCK gives the header n units after (or before) B
+ */
+///@{
+#define BLOCK(B,N)      ((HEADER *)((char *)(B)+(intptr_t)(N)*MEM_UNIT))
+#define NEXTBLOCK(B)    BLOCK(B,(B)->size)
+#define NEXTFREE(B)     (((FREELINK *)((B)+1))->next)
+#define FREEPREV(B)     (((FREELINK *)((B)+1))->prev)
+///@}
+
+/**
+ *  @brief  Minimal size of a block in MEM_UNIT units
+ *
+ *  @note   A free block must hold its header, its links and, for boundary tags,
+ *          its footer. With MEM_INSTRUMENT, a used block in a cache or remote
+ *          list must also keep the last byte of its slack after the link.
+ */
+#if defined(MEM_BINS) || defined(MEM_BOUNDARYTAGS)
+#define MINBLOCK        ((2*sizeof(HEADER)+sizeof(FREELINK)+MEM_UNIT-1)/MEM_UNIT)
+#elif defined(MEM_INSTRUMENT)
+#define MINBLOCK        ((sizeof(HEADER)+sizeof(HEADER *)+1+MEM_UNIT-1)/MEM_UNIT)
+#else
+#define MINBLOCK        ((sizeof(HEADER)+sizeof(HEADER *)+MEM_UNIT-1)/MEM_UNIT)
+#endif
+
+/**
+ *  @brief  Boundary tags
+ *
+ *  @note   FOOTER is the last word of a free block. PREVBLOCK is only valid
+ *          when the prevfree bit is set.
+ */
+///@{
+#ifdef MEM_BOUNDARYTAGS
+#define FOOTER(B)       (NEXTBLOCK(B)[-1].word)
+#define PREVBLOCK(B)    BLOCK(B,-(intptr_t)(B)[-1].word)
+#endif
+///@}
+
+/**
+ *  @brief  Number of size classes
+ *
+ *  @note   For MEM_SEGREGATED, bin i holds free blocks with size in [2^i,2^(i+1))
+ *          units, so one bin for each bit of the size field.
+ *
+ *  @note   For MEM_TLSF, each power of two (first level) is divided in
+ *          2^MEM_TLSF_SLBITS linear classes (second level). Sizes below
+ *          2^MEM_TLSF_SLBITS units are all in the first level 0.
+ */
+#ifdef MEM_TLSF
+#ifndef MEM_TLSF_SLBITS
+#define MEM_TLSF_SLBITS 4
+#endif
+#define MEM_SLCOUNT     (1<<MEM_TLSF_SLBITS)
+#define MEM_FLCOUNT     (MEM_SIZEBITS-MEM_TLSF_SLBITS+1)
+#define MEM_NBINS       (MEM_FLCOUNT*MEM_SLCOUNT)
+#else
+#define MEM_NBINS       MEM_SIZEBITS
+#endif
+
+/**
+ *  @brief  Region locks
+ *
+ *  @note   With MEM_THREADS, each region has its own lock. It is a spinlock by
+ *          default. With MEM_LOCK_FUTEX (Linux only), a thread waiting for a
+ *          lock sleeps in the kernel instead.
+ *
+ *  @note   Lock states for futex: 0 free, 1 locked, 2 locked with waiters
+ */
+#ifdef MEM_THREADS
+#include <stdatomic.h>
+#ifdef MEM_LOCK_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef atomic_int MEMLOCK;
+
+static void MemLock(MEMLOCK *l) {
+#ifdef MEM_LOCK_FUTEX
+int c = 0;
+
+    if( atomic_compare_exchange_strong_explicit(l,&c,1,memory_order_acquire,memory_order_relaxed) )
+        return;
+    if( c != 2 )
+        c = atomic_exchange_explicit(l,2,memory_order_acquire);
+    while( c != 0 ) {
+        syscall(SYS_futex,l,FUTEX_WAIT_PRIVATE,2,NULL,NULL,0);
+        c = atomic_exchange_explicit(l,2,memory_order_acquire);
+    }
+#else
+    while( atomic_exchange_explicit(l,1,memory_order_acquire) ) {
+        while( atomic_load_explicit(l,memory_order_relaxed) ) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+#endif
+}
+
+static void MemUnlock(MEMLOCK *l) {
+#ifdef MEM_LOCK_FUTEX
+    if( atomic_exchange_explicit(l,0,memory_order_release) == 2 )
+        syscall(SYS_futex,l,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+#else
+    atomic_store_explicit(l,0,memory_order_release);
+#endif
+}
+
+#define LOCK(R)         MemLock(&(R)->lock)
+#define UNLOCK(R)       MemUnlock(&(R)->lock)
+#else
+#define LOCK(R)
+#define UNLOCK(R)
+#endif
+
+/**
+ *  @brief  Slabs of small objects
+ *
+ *  @note   With MEM_SLAB, a region can also have an area of slabs, added with
+ *          MemAddRegionType and MEM_REGION_SLAB. Each slab has MEM_SLAB_BYTES
+ *          bytes, is aligned to them and holds objects of a single size, a
+ *          multiple of MEM_UNIT up to MEM_SLAB_MAX bytes. Objects have no
+ *          header, so the slab of an object is found by masking its address.
+ *
+ *  @note   Free objects of a slab are linked through their first word.
+ *          Objects never used are taken from the end of the used part, so a
+ *          slab is not walked when it gets a size.
+ */
+#ifdef MEM_SLAB
+#ifndef MEM_SLAB_BYTES
+#define MEM_SLAB_BYTES  4096
+#endif
+#ifndef MEM_SLAB_MAX
+#define MEM_SLAB_MAX    128
+#endif
+/// Number of object sizes, one for each number of units
+#define MEM_SLAB_CLASSES ((MEM_SLAB_MAX+MEM_UNIT-1)/MEM_UNIT)
+
+#if (MEM_SLAB_BYTES&(MEM_SLAB_BYTES-1)) != 0 || MEM_SLAB_BYTES < 8*MEM_SLAB_MAX
+#error "MEM_SLAB_BYTES must be a power of two with room for several objects"
+#endif
+
+typedef struct slab {
+    struct slab *next;                  ///< Next slab with the same size, or next empty slab
+    struct slab *prev;                  ///< Previous slab with the same size
+    void        *free;                  ///< First free object
+    char        *unused;                ///< First object never used
+    uint32_t     size;                  ///< Bytes of each object
+    uint32_t     used;                  ///< Number of used objects
+} SLAB;
+#endif
+
 /**
  *  @brief  Region definition
  *
  *  @note   Definition of a heap area
+ *
+ *  @note   The area ends with a sentinel header (used, size 0), so blocks can
+ *          be walked from start until a zero size is found
  */
 
 typedef struct region {
     HEADER  *start;                     ///< Start address of this heap
-    HEADER  *end;                       ///< End address of this heap
+    HEADER  *end;                       ///< Sentinel at the end of this heap
+#ifdef MEM_BESTFIT
+    HEADER  *root;                      ///< Tree of free blocks by size and address
+#elif defined(MEM_BINS)
+#ifdef MEM_TLSF
+    HWORD    flmap;                     ///< Bit i is set when slmap[i] is not zero
+    uint32_t slmap[MEM_FLCOUNT];        ///< Bit j of slmap[i] is set when bins[i,j] is not empty
+#else
+    HWORD    binmap;                    ///< Bit i is set when bins[i] is not empty
+#endif
+    HEADER  *bins[MEM_NBINS];           ///< Free lists by size class
+#else
     HEADER  *free;                      ///< Pointer to first free block (Free list)
-    int32_t  memleft;                   ///< Free area in sizeof(HEADER) units
+#ifdef MEM_NEXTFIT
+    HEADER  *rover;                     ///< Free block before the next search, NULL for the first one
+#endif
+#endif
+#if defined(MEM_BUDDY) || defined(MEM_BITMAP)
+    uint32_t type;                      ///< MEM_REGION_LIST, MEM_REGION_BUDDY or MEM_REGION_BITMAP
+#endif
+#ifdef MEM_BUDDY
+    HWORD    ordermap;                  ///< Bit k is set when orders[k] is not empty
+    char    *orders[MEM_SIZEBITS];      ///< Free blocks of a buddy region with 2^k units
+    unsigned char *buddymap;            ///< Order and state of the blocks of a buddy region
+#endif
+#ifdef MEM_BITMAP
+    uint64_t *bitmap;                   ///< Bit i is set when unit i of a bitmap region is used
+    HWORD    bitunits;                  ///< Number of units of a bitmap region
+    HWORD    bitwords;                  ///< Number of words of the bitmap
+    HWORD    bitfirst;                  ///< All units before it are used
+#endif
+#ifdef MEM_SLAB
+    char    *slabstart;                 ///< Area of slabs, aligned to MEM_SLAB_BYTES
+    char    *slabend;                   ///< End of the area of slabs
+    char    *slabtop;                   ///< Slabs from here on were never used
+    SLAB    *slabempty;                 ///< Slabs without used objects
+    SLAB    *slabs[MEM_SLAB_CLASSES+1]; ///< Slabs with free objects, by object size in units
+    size_t   slabobjects;               ///< Number of used objects
+    size_t   slabbytes;                 ///< Bytes of the used objects
+#endif
+    HWORD    memleft;                   ///< Free area in MEM_UNIT units
+    HWORD    memsize;                   ///< Area of all blocks in MEM_UNIT units
+    HWORD    maxused;                   ///< Highest used area in MEM_UNIT units
+    HWORD    freeblocks;                ///< Number of free blocks
+    HWORD    usedblocks;                ///< Number of used blocks
+    uint64_t allocs;                    ///< Number of blocks taken from the free list(s)
+    uint64_t frees;                     ///< Number of blocks returned to the free list(s)
+#ifdef MEM_INSTRUMENT
+    uint64_t reqbytes;                  ///< Bytes requested from the used blocks
+    uint64_t allocbytes;                ///< Bytes of the used blocks
+#endif
+#ifdef MEM_GROWABLE
+    char    *commit;                    ///< End of the memory committed to a growable region
+    char    *limit;                     ///< End of the reserved memory, NULL when it can not grow
+#endif
+#ifdef MEM_TRIM_THRESHOLD
+    HWORD    trimmark;                  ///< Lowest memleft since the last trim
+#endif
+#ifdef MEM_THREADS
+    MEMLOCK  lock;                      ///< Lock for all fields above
+#endif
+#ifdef MEM_REMOTEFREE
+    _Atomic(HEADER *) remote;           ///< Blocks freed by other threads
+    _Atomic(void *)   owner;            ///< Last thread to allocate
+#endif
 } REGION;
 
 /**
@@ -88,393 +452,5711 @@ typedef struct region {
  *
  *  @note   Heap information loaded by MemInit
  *
- *  @note   To change the number of regions, the region field in HEADER must be changed too
+ *  @note   The number of regions is limited by the region field in HEADER
  */
-static REGION Regions[4] = {
-    { .start = 0, .end = 0 },
-    { .start = 0, .end = 0 },
-    { .start = 0, .end = 0 },
+static REGION Regions[MEM_NREGIONS] = {
     { .start = 0, .end = 0 }
 };
 
+/// Number of regions
+#define NREGIONS        (sizeof(Regions)/sizeof(REGION))
+
+/// Not zero for a buddy region
+#ifdef MEM_BUDDY
+#define ISBUDDY(R)      ((R)->type == MEM_REGION_BUDDY)
+#else
+#define ISBUDDY(R)      0
+#endif
+
+/// Not zero for a bitmap region
+#ifdef MEM_BITMAP
+#define ISBITMAP(R)     ((R)->type == MEM_REGION_BITMAP)
+#else
+#define ISBITMAP(R)     0
+#endif
 
 /**
- *  @brief  Add a region to the pool
+ *  @brief  Next fit rover
  *
- *  @note   Area must be aligned to an uint32_t
+ *  @note   When a free block is combined into another one, a rover pointing to
+ *          it is moved to the block that now holds it
  */
-void
-MemAddRegion( uint32_t region, void *area, uint32_t size) {
-REGION *r;
+#ifdef MEM_NEXTFIT
+#define ROVER(R,OLD,NEW)    do { if( (R)->rover == (OLD) ) (R)->rover = (NEW); } while(0)
+#else
+#define ROVER(R,OLD,NEW)
+#endif
 
-    r = &Regions[region];
+/**
+ *  @brief  Bytes requested from used blocks (MEM_INSTRUMENT)
+ *
+ *  @note   The bytes of a used block after the ones requested are its slack.
+ *          When there are any, the slack bit of the header is set and the
+ *          last byte of the block holds the slack, or SLACKBIG and the
+ *          sizeof(size_t) bytes before it when it is larger. MemSize does not
+ *          count them, so a caller never overwrites them.
+ *
+ *  @note   reqbytes and allocbytes of the region are increased when a block
+ *          is given (REQUEST) and decreased when it is freed or resized
+ *          (UNREQUEST), so they are the ones of the blocks in use. Lock of the region must be held.
+ *
+ *  @note   Without MEM_INSTRUMENT, nothing is recorded and the header, MINBLOCK
+ *          and MemSize are not changed.
+ */
+///@{
+#ifdef MEM_INSTRUMENT
+#define SLACKBIG        0xFF
 
-    // If already initialized, do nothing
-    if( r->start )
-        return;
+/// Bytes at the end of the used block B that hold its slack
+#define SLACKBYTES(B)   (!(B)->slack ? 0 : ((unsigned char *)NEXTBLOCK(B))[-1] != SLACKBIG ? 1 : 1+sizeof(size_t))
+
+/// Record that nb bytes are requested from the used block b
+static void BlockSetRequest(HEADER *b, size_t nb) {
+unsigned char *end;
+size_t slack;
+int32_t i;
+
+    slack = b->size*MEM_UNIT-sizeof(HEADER)-nb;
+    b->slack = slack != 0;
+    end = (unsigned char *) NEXTBLOCK(b);
+    if( slack >= SLACKBIG ) {
+        end[-1] = SLACKBIG;
+        for(i=2;i<=1+(int32_t)sizeof(size_t);i++,slack>>=8)
+            end[-i] = (unsigned char) slack;
+    } else if( slack ) {
+        end[-1] = (unsigned char) slack;
+    }
+}
+
+/// Bytes requested from the used block b
+static size_t BlockRequested(HEADER *b) {
+unsigned char *end;
+size_t slack = 0;
+int32_t i;
+
+    if( b->slack ) {
+        end = (unsigned char *) NEXTBLOCK(b);
+        if( end[-1] != SLACKBIG ) {
+            slack = end[-1];
+        } else {
+            for(i=1+(int32_t)sizeof(size_t);i>=2;i--)
+                slack = slack<<8|end[-i];
+        }
+    }
+    return b->size*MEM_UNIT-sizeof(HEADER)-slack;
+}
+
+/// Give the used block b of region r to a request of nb bytes
+static void BlockRequest(REGION *r, HEADER *b, size_t nb) {
+
+    BlockSetRequest(b,nb);
+    r->reqbytes   += nb;
+    r->allocbytes += b->size*MEM_UNIT;
+}
+
+/// Take back the used block b of region r before it is freed or resized
+static void BlockUnrequest(REGION *r, HEADER *b) {
+
+    r->reqbytes   -= BlockRequested(b);
+    r->allocbytes -= b->size*MEM_UNIT;
+    b->slack = 0;
+}
+
+#define REQUEST(R,B,NB)     BlockRequest(R,B,NB)
+#define UNREQUEST(R,B)      BlockUnrequest(R,B)
+#else
+#define SLACKBYTES(B)       0
+#define REQUEST(R,B,NB)     ((void)(NB))
+#define UNREQUEST(R,B)
+#endif
+///@}
+
+#ifdef MEM_BOUNDARYTAGS
+
+/**
+ *  @brief  Mark a block as free
+ *
+ *  @note   Writes the footer and informs the following block
+ */
+static void TagFree(HEADER *b) {
+
+    b->used = 0;
+    FOOTER(b) = b->size;
+    NEXTBLOCK(b)->prevfree = 1;
+}
+
+/**
+ *  @brief  Mark a block as used
+ */
+static void TagUsed(HEADER *b) {
+
+    b->used = 1;
+    NEXTBLOCK(b)->prevfree = 0;
+}
+
+#endif
+
+#if defined(MEM_SEGREGATED) || defined(MEM_TLSF) || defined(MEM_BUDDY) || defined(MEM_BITMAP)
+
+/**
+ *  @brief  Index of the most significant bit set
+ *
+ *  @note   x must not be zero
+ */
+static int32_t BitHigh(uint64_t x) {
+#if defined(__GNUC__)
+    return 63-__builtin_clzll(x);
+#else
+int32_t n = 0;
+
+    while( x >>= 1 )
+        n++;
+    return n;
+#endif
+}
+
+/**
+ *  @brief  Index of the least significant bit set
+ *
+ *  @note   x must not be zero
+ */
+static int32_t BitLow(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+int32_t n = 0;
+
+    while( (x&1) == 0 ) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+#endif
+
+#ifdef MEM_BESTFIT
+
+/**
+ *  @brief  Tree of free blocks
+ *
+ *  @note   A treap: a binary search tree by size and then address, that is
+ *          also a heap by a priority. The priority is a hash of the address,
+ *          so the tree has the shape of one built in random order, with an
+ *          expected depth of O(log n), and no field is needed to balance it.
+ *
+ *  @note   The two links of a free block are its left and right children.
+ *          There is no parent link, so a block is removed by searching its key.
+ */
+///@{
+#define TREELEFT(B)     NEXTFREE(B)
+#define TREERIGHT(B)    FREEPREV(B)
+
+/// Priority of a block in the heap
+static uintptr_t TreePriority(HEADER *b) {
+
+    return (uintptr_t) b*(uintptr_t) 0x9E3779B97F4A7C15ULL;
+}
+
+/// Returns not zero when a comes before b in the tree
+static int32_t TreeLess(HEADER *a, HEADER *b) {
+
+    return a->size < b->size || (a->size == b->size && a < b);
+}
+///@}
+
+/**
+ *  @brief  Insert a free block in the tree
+ *
+ *  @note   The block goes down to the first node with a lower priority, and
+ *          that subtree is split in the blocks before it and after it
+ */
+static void BinInsert(REGION *r, HEADER *b) {
+HEADER **link, **before, **after, *t;
+uintptr_t priority = TreePriority(b);
+
+    TagFree(b);
+    link = &r->root;
+    while( *link && TreePriority(*link) > priority )
+        link = TreeLess(b,*link) ? &TREELEFT(*link) : &TREERIGHT(*link);
+
+    before = &TREELEFT(b);
+    after  = &TREERIGHT(b);
+    for(t=*link;t;) {
+        if( TreeLess(t,b) ) {
+            *before = t;
+            before = &TREERIGHT(t);
+            t = TREERIGHT(t);
+        } else {
+            *after = t;
+            after = &TREELEFT(t);
+            t = TREELEFT(t);
+        }
+    }
+    *before = NULL;
+    *after  = NULL;
+    *link = b;
+    r->freeblocks++;
+}
+
+/**
+ *  @brief  Remove a free block from the tree
+ *
+ *  @note   Its size must not have changed since it was inserted. Its subtrees
+ *          are merged in its place.
+ */
+static void BinRemove(REGION *r, HEADER *b) {
+HEADER **link, *left, *right;
+
+    link = &r->root;
+    while( *link != b )
+        link = TreeLess(b,*link) ? &TREELEFT(*link) : &TREERIGHT(*link);
+
+    left  = TREELEFT(b);
+    right = TREERIGHT(b);
+    while( left && right ) {
+        if( TreePriority(left) > TreePriority(right) ) {
+            *link = left;
+            link  = &TREERIGHT(left);
+            left  = TREERIGHT(left);
+        } else {
+            *link = right;
+            link  = &TREELEFT(right);
+            right = TREELEFT(right);
+        }
+    }
+    *link = left ? left : right;
+    r->freeblocks--;
+}
+
+/**
+ *  @brief  Find the smallest free block with at least nelems units
+ *
+ *  @note   Among blocks of the same size, the one with the lowest address
+ */
+static HEADER *BinFind(REGION *r, HWORD nelems) {
+HEADER *t, *best = NULL;
+
+    for(t=r->root;t;) {
+        if( nelems <= t->size ) {
+            best = t;
+            t = TREELEFT(t);
+        } else {
+            t = TREERIGHT(t);
+        }
+    }
+    return best;
+}
+
+/// Largest free block, the last one of the tree, or NULL
+static HEADER *BinLargest(REGION *r) {
+HEADER *t;
+
+    for(t=r->root;t && TREERIGHT(t);t=TREERIGHT(t))
+        ;
+    return t;
+}
+
+#elif defined(MEM_BINS)
+
+#ifdef MEM_TLSF
+
+/**
+ *  @brief  Size class of a block with size units
+ *
+ *  @note   Returns first level * MEM_SLCOUNT + second level
+ */
+static int32_t BinIndex(HWORD size) {
+int32_t fl;
 
-    r->start = area;
-    r->end   = (HEADER *)((char *) area + size);
-    r->free  = area;
-    r->free->next = NULL;
-    r->free->size = size/sizeof(HEADER)-1;
-    r->free->used = 0;
-    r->memleft = r->free->size;
+    if( size < MEM_SLCOUNT )
+        return size;
+    fl = BitHigh(size);
+    return (fl-MEM_TLSF_SLBITS+1)*MEM_SLCOUNT + ((size>>(fl-MEM_TLSF_SLBITS))-MEM_SLCOUNT);
+}
+
+/// Marks bin i as not empty
+static void BinSet(REGION *r, int32_t i) {
+
+    r->slmap[i/MEM_SLCOUNT] |= 1UL<<(i%MEM_SLCOUNT);
+    r->flmap |= (HWORD)1<<(i/MEM_SLCOUNT);
+}
+
+/// Marks bin i as empty
+static void BinClear(REGION *r, int32_t i) {
+
+    r->slmap[i/MEM_SLCOUNT] &= ~(1UL<<(i%MEM_SLCOUNT));
+    if( !r->slmap[i/MEM_SLCOUNT] )
+        r->flmap &= ~((HWORD)1<<(i/MEM_SLCOUNT));
+}
+
+#if defined(DEBUG) || defined(TEST)
+/// Returns not zero when bin i is marked as not empty
+static int32_t BinIsSet(REGION *r, int32_t i) {
+
+    return (r->slmap[i/MEM_SLCOUNT]>>(i%MEM_SLCOUNT))&1;
+}
+#endif
+
+#else
+
+/// Size class of a block with size units
+static int32_t BinIndex(HWORD size) {
+
+    return BitHigh(size);
+}
+
+/// Marks bin i as not empty
+static void BinSet(REGION *r, int32_t i) {
+
+    r->binmap |= (HWORD)1<<i;
+}
+
+/// Marks bin i as empty
+static void BinClear(REGION *r, int32_t i) {
+
+    r->binmap &= ~((HWORD)1<<i);
+}
+
+#if defined(DEBUG) || defined(TEST)
+/// Returns not zero when bin i is marked as not empty
+static int32_t BinIsSet(REGION *r, int32_t i) {
+
+    return (r->binmap>>i)&1;
+}
+#endif
+
+#endif
+
+/**
+ *  @brief  Insert a free block in the list of its size class
+ *
+ *  @note   Blocks are inserted at the head, so recently freed blocks are reused first
+ */
+static void BinInsert(REGION *r, HEADER *b) {
+int32_t i = BinIndex(b->size);
+
+#ifdef MEM_BOUNDARYTAGS
+    TagFree(b);
+#else
+    b->used = 0;
+#endif
+    NEXTFREE(b) = r->bins[i];
+    FREEPREV(b) = NULL;
+    if( NEXTFREE(b) )
+        FREEPREV(NEXTFREE(b)) = b;
+    r->bins[i] = b;
+    BinSet(r,i);
+    r->freeblocks++;
+}
+
+/**
+ *  @brief  Remove a free block from the list of its size class
+ */
+static void BinRemove(REGION *r, HEADER *b) {
+int32_t i = BinIndex(b->size);
+
+    if( FREEPREV(b) )
+        NEXTFREE(FREEPREV(b)) = NEXTFREE(b);
+    else
+        r->bins[i] = NEXTFREE(b);
+    if( NEXTFREE(b) )
+        FREEPREV(NEXTFREE(b)) = FREEPREV(b);
+    if( !r->bins[i] )
+        BinClear(r,i);
+    r->freeblocks--;
+}
+
+#ifdef MEM_TLSF
+
+/**
+ *  @brief  Find a free block with at least nelems units
+ *
+ *  @note   The size is rounded up to the next class boundary, so every block
+ *          in the class found fits. Finding the class needs two bit scans.
+ *
+ *  @note   When nothing is found, the head of the class of nelems is tried,
+ *          so a block with exactly the size requested is not missed.
+ */
+static HEADER *BinFind(REGION *r, HWORD nelems) {
+int32_t fl, sl, i;
+uint32_t map;
+HWORD flmap, size;
+HEADER *b;
+
+    size = nelems;
+    if( size >= MEM_SLCOUNT )
+        size += ((HWORD)1<<(BitHigh(size)-MEM_TLSF_SLBITS))-1;
+
+    if( (size>>MEM_SIZEBITS) == 0 ) {
+        i  = BinIndex(size);
+        fl = i/MEM_SLCOUNT;
+        sl = i%MEM_SLCOUNT;
+        map = r->slmap[fl] & (~0UL<<sl);
+        if( !map ) {
+            flmap = (fl+1 < MEM_FLCOUNT) ? r->flmap & (~(HWORD)0<<(fl+1)) : 0;
+            if( flmap ) {
+                fl  = BitLow(flmap);
+                map = r->slmap[fl];
+            }
+        }
+        if( map )
+            return r->bins[fl*MEM_SLCOUNT+BitLow(map)];
+    }
+
+    b = r->bins[BinIndex(nelems)];
+    if( b && nelems <= b->size )
+        return b;
+    return NULL;
+}
+
+/// A free block of the highest non empty class, or NULL
+static HEADER *BinLargest(REGION *r) {
+int32_t fl;
+
+    if( !r->flmap )
+        return NULL;
+    fl = BitHigh(r->flmap);
+    return r->bins[fl*MEM_SLCOUNT+BitHigh(r->slmap[fl])];
+}
+
+#else
+
+/**
+ *  @brief  Find a free block with at least nelems units
+ *
+ *  @note   Every block in a bin above the class of nelems fits, so the bitmap
+ *          gives one in constant time. Only when there is none, the list of the
+ *          class of nelems is searched.
+ */
+static HEADER *BinFind(REGION *r, HWORD nelems) {
+int32_t i;
+HWORD map;
+HEADER *b;
+
+    i = BitHigh(nelems);
+
+    /* A power of two fits every block of its own class */
+    if( (nelems&(nelems-1)) == 0 && r->bins[i] )
+        return r->bins[i];
+
+    map = (i+1 < MEM_NBINS) ? r->binmap & (~(HWORD)0<<(i+1)) : 0;
+    if( map )
+        return r->bins[BitLow(map)];
+
+    for(b=r->bins[i];b;b=NEXTFREE(b)) {
+        if( nelems <= b->size )
+            return b;
+    }
+    return NULL;
+}
+
+/// A free block of the highest non empty class, or NULL
+static HEADER *BinLargest(REGION *r) {
+
+    if( !r->binmap )
+        return NULL;
+    return r->bins[BitHigh(r->binmap)];
+}
+
+#endif
+
+#ifndef MEM_BOUNDARYTAGS
+
+/**
+ *  @brief  Combine all contiguous free blocks
+ *
+ *  @note   MemFree only combines a block with the following one. Blocks with a
+ *          free block before them are combined here, when an allocation fails.
+ *
+ *  @note   Returns the number of combinations done
+ */
+static uint32_t BinConsolidate(REGION *r) {
+HEADER *p, *q;
+uint32_t n = 0;
+
+    for(p=r->start;p->size>0;p=NEXTBLOCK(p)) {
+        if( p->used )
+            continue;
+        q = NEXTBLOCK(p);
+        if( q->used )
+            continue;
+        BinRemove(r,p);
+        while( !q->used ) {
+            BinRemove(r,q);
+            p->size += q->size;
+            q = NEXTBLOCK(p);
+            n++;
+        }
+        BinInsert(r,p);
+    }
+    return n;
+}
+
+#endif
+
+#endif
+
+#ifdef MEM_BUDDY
+
+/**
+ *  @brief  Buddy regions
+ *
+ *  @note   All blocks of a buddy region have 2^k units and are aligned to
+ *          2^k*MEM_UNIT bytes. The buddy of a block is found by flipping that
+ *          bit in its address, so blocks are split and combined with address
+ *          arithmetic only.
+ *
+ *  @note   Blocks have no header, so a request of 2^k units gets a block of
+ *          order k. The order of each block and whether it is used are kept
+ *          in a map with a byte for each smallest block, at the end of the
+ *          area, indexed by the offset of the block from the start. MemFree
+ *          finds the region by address, as for slab objects.
+ *
+ *  @note   The area is cut in the largest aligned blocks that fit. A block
+ *          whose buddy is not entirely in the region is never combined.
+ *
+ *  @note   Free blocks are in a doubly linked list for each order k, with a
+ *          bitmap of the non empty lists. The links are at the start of the
+ *          free block.
+ */
+///@{
+/// Units of the two links of a free block
+#define BUDDYUNITS      ((sizeof(FREELINK)+MEM_UNIT-1)/MEM_UNIT)
+/// Smallest block, BUDDYUNITS rounded to a power of two
+#define BUDDYMIN        (BUDDYUNITS<=1?1:BUDDYUNITS<=2?2:BUDDYUNITS<=4?4:8)
+/// Bytes of the smallest block
+#define BUDDYBYTES      (BUDDYMIN*MEM_UNIT)
+/// Index in the map of the block at P
+#define BUDDYINDEX(R,P) ((size_t)((char *)(P)-(char *)(R)->start)/BUDDYBYTES)
+/// Map entry of the block at P: its order and BUDDYUSED
+#define BUDDYMAP(R,P)   ((R)->buddymap[BUDDYINDEX(R,P)])
+#define BUDDYUSED       0x80
+#define BUDDYORDER      0x7F
+/// Links of the free block at P
+#define BUDDYNEXT(P)    (((char **)(P))[0])
+#define BUDDYPREV(P)    (((char **)(P))[1])
+
+/// Units needed for nb bytes
+#define BUDDYNELEMS(NB) ((HWORD)(((NB)+MEM_UNIT-1)/MEM_UNIT))
+
+/// Regions of buddy blocks, for MemFree to find the region of a block
+static REGION *BuddyRegions[MEM_NREGIONS];
+static uint32_t NBuddyRegions;
+
+/// Order of the smallest block with nelems units
+static int32_t BuddyOrder(HWORD nelems) {
+
+    if( nelems <= BUDDYMIN )
+        nelems = BUDDYMIN;
+    return nelems == 1 ? 0 : BitHigh(nelems-1)+1;
+}
+
+/// Region whose buddy blocks hold p, or NULL
+static REGION *BuddyRegion(void *p) {
+uint32_t i;
+
+    for(i=0;i<NBuddyRegions;i++) {
+        if( (HEADER *) p >= BuddyRegions[i]->start && (HEADER *) p < BuddyRegions[i]->end )
+            return BuddyRegions[i];
+    }
+    return NULL;
+}
+
+/// Buddy of block b of order k, or NULL when it is not entirely in the region
+static char *BuddyOf(REGION *r, char *b, int32_t k) {
+char *buddy;
+
+    buddy = (char *) ((uintptr_t) b^(((uintptr_t) 1)<<k)*MEM_UNIT);
+    if( buddy < (char *) r->start || buddy+(((size_t) 1)<<k)*MEM_UNIT > (char *) r->end )
+        return NULL;
+    return buddy;
+}
+
+static void BuddyInsert(REGION *r, char *b, int32_t k) {
+
+    BUDDYMAP(r,b) = k;
+    BUDDYNEXT(b) = r->orders[k];
+    BUDDYPREV(b) = NULL;
+    if( r->orders[k] )
+        BUDDYPREV(r->orders[k]) = b;
+    r->orders[k] = b;
+    r->ordermap |= ((HWORD)1)<<k;
+    r->freeblocks++;
+}
+
+static void BuddyRemove(REGION *r, char *b, int32_t k) {
+
+    if( BUDDYPREV(b) )
+        BUDDYNEXT(BUDDYPREV(b)) = BUDDYNEXT(b);
+    else
+        r->orders[k] = BUDDYNEXT(b);
+    if( BUDDYNEXT(b) )
+        BUDDYPREV(BUDDYNEXT(b)) = BUDDYPREV(b);
+    if( !r->orders[k] )
+        r->ordermap &= ~(((HWORD)1)<<k);
+    r->freeblocks--;
+}
+///@}
+
+/**
+ *  @brief  Initialize a buddy region with an area
+ *
+ *  @note   If the region is already initialized, does nothing. The map takes
+ *          a byte for each smallest block at the end of the area.
+ */
+static void BuddyAddArea(REGION *r, void *area, size_t size) {
+char *b;
+uintptr_t start, end, nunits;
+int32_t k;
+
+    if( r->start )
+        return;
+
+    /* Blocks aligned to the smallest block, followed by their map */
+    start = ((uintptr_t) area+BUDDYBYTES-1)&~(uintptr_t)(BUDDYBYTES-1);
+    end   = (uintptr_t) area+size;
+    if( end <= start || (end-start)/(BUDDYBYTES+1) == 0 )
+        return;
+    nunits = (end-start)/(BUDDYBYTES+1)*BUDDYMIN;
+    if( nunits > MAXUNITS )
+        nunits = MAXUNITS/BUDDYMIN*BUDDYMIN;
+    end = start+nunits*MEM_UNIT;
+
+    r->start = (HEADER *) start;
+    r->end   = (HEADER *) end;
+    r->buddymap = (unsigned char *) end;
+    r->type  = MEM_REGION_BUDDY;
+    r->memleft = nunits;
+    r->memsize = nunits;
+#ifdef MEM_TRIM_THRESHOLD
+    r->trimmark = r->memleft;
+#endif
+
+    for(b=(char *)start;b!=(char *)end;b+=(((size_t)1)<<k)*MEM_UNIT) {
+        nunits = ((uintptr_t) end-(uintptr_t) b)/MEM_UNIT;
+        for(k=BitHigh(nunits);(((uintptr_t) b/MEM_UNIT)&((((uintptr_t)1)<<k)-1)) != 0;k--)
+            ;
+        BuddyInsert(r,b,k);
+    }
+    BuddyRegions[NBuddyRegions++] = r;
+}
+
+/**
+ *  @brief  BuddyAlloc
+ *
+ *  @note   Returns a block with at least nelems units, or NULL. The smallest
+ *          free block large enough is halved until it has the size needed,
+ *          and the upper halves are freed.
+ *
+ *  @note   Lock of the region must be held
+ */
+static void *BuddyAlloc(REGION *r, HWORD nelems) {
+char *block;
+HWORD map;
+int32_t j, k;
+
+    k = BuddyOrder(nelems);
+    if( k >= MEM_SIZEBITS )
+        return NULL;
+    map = r->ordermap&~((((HWORD)1)<<k)-1);
+    if( !map )
+        return NULL;
+    j = BitLow(map);
+    block = r->orders[j];
+    BuddyRemove(r,block,j);
+    while( j > k ) {
+        j--;
+        BuddyInsert(r,block+(((size_t)1)<<j)*MEM_UNIT,j);
+    }
+
+    BUDDYMAP(r,block) = k|BUDDYUSED;
+    r->memleft -= ((HWORD)1)<<k;
+    r->usedblocks++;
+    r->allocs++;
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+    return block;
+}
+
+/**
+ *  @brief  BuddyFree
+ *
+ *  @note   Combines the used block b with its buddy while the buddy is free
+ *          and whole, then puts it in the list of its order. A block already
+ *          free is ignored.
+ *
+ *  @note   Lock of the region must be held
+ */
+static void BuddyFree(REGION *r, char *b) {
+char *buddy;
+int32_t k;
+
+    if( !(BUDDYMAP(r,b)&BUDDYUSED) )
+        return;
+    k = BUDDYMAP(r,b)&BUDDYORDER;
+    r->memleft += ((HWORD)1)<<k;
+    r->usedblocks--;
+    r->frees++;
+    while( (buddy = BuddyOf(r,b,k)) != NULL && BUDDYMAP(r,buddy) == k ) {
+        BuddyRemove(r,buddy,k);
+        if( buddy < b )
+            b = buddy;
+        k++;
+    }
+    BuddyInsert(r,b,k);
+}
+
+/**
+ *  @brief  BuddyResize
+ *
+ *  @note   Shrinks the used block b by freeing its upper halves while it keeps
+ *          nelems units. A block never grows in place, so returns -1 when
+ *          nelems is more than its size.
+ *
+ *  @note   Lock of the region must be held
+ */
+static int32_t BuddyResize(REGION *r, char *b, HWORD nelems) {
+int32_t j, k;
+
+    k = BuddyOrder(nelems);
+    j = BUDDYMAP(r,b)&BUDDYORDER;
+    if( k > j )
+        return -1;
+    while( j > k ) {
+        j--;
+        BuddyInsert(r,b+(((size_t)1)<<j)*MEM_UNIT,j);
+        r->memleft += ((HWORD)1)<<j;
+    }
+    BUDDYMAP(r,b) = k|BUDDYUSED;
+    return 0;
+}
+
+/// Bytes of the used block p of region r
+static size_t BuddySize(REGION *r, void *p) {
+
+    return (((size_t)1)<<(BUDDYMAP(r,p)&BUDDYORDER))*MEM_UNIT;
+}
+
+#endif
+
+#ifdef MEM_BITMAP
+
+/**
+ *  @brief  Bitmap regions
+ *
+ *  @note   A bitmap region has a bit for each unit, set when the unit is in a
+ *          used block. Free blocks are not linked: a block is found as a run
+ *          of clear bits long enough, with bit scans on whole words. Words
+ *          with all units used or all free are skipped with SSE2 or AVX2
+ *          compares when the compiler targets them.
+ *
+ *  @note   The bitmap is at the start of the area, and the bits after the
+ *          last unit are set. Used blocks have the headers of the other
+ *          regions, so MemFree finds the region the same way. A free run has
+ *          a header at its start and a copy of it at its end, so MemFree
+ *          combines it with its neighbours without scanning, and the blocks
+ *          can still be walked.
+ *
+ *  @note   Vectors use compiler extensions and builtins, so no header is
+ *          needed. MEM_BITMAP_NOSIMD, or another compiler or processor,
+ *          leaves the loop on single words.
+ */
+///@{
+#if defined(__GNUC__) && !defined(MEM_BITMAP_NOSIMD)
+#if defined(__AVX2__)
+typedef uint64_t BITVEC __attribute__((vector_size(32),aligned(8),may_alias));
+typedef char BITVECBYTES __attribute__((vector_size(32)));
+#define BITVECWORDS     4
+#define BITVECEQUAL(A,B) (__builtin_ia32_pmovmskb256((BITVECBYTES) ((A) == (B))) == -1)
+#elif defined(__SSE2__)
+typedef uint64_t BITVEC __attribute__((vector_size(16),aligned(8),may_alias));
+typedef char BITVECBYTES __attribute__((vector_size(16)));
+#define BITVECWORDS     2
+#define BITVECEQUAL(A,B) (__builtin_ia32_pmovmskb128((BITVECBYTES) ((A) == (B))) == 0xFFFF)
+#endif
+#endif
+
+/// Words of a bitmap with no unit used and with all units used
+#define BITSCLEAR       ((uint64_t)0)
+#define BITSSET         (~(uint64_t)0)
+/// Unit of block B in region R
+#define BITUNIT(R,B)    ((HWORD) (((char *)(B)-(char *)(R)->start)/MEM_UNIT))
+/// Not zero when unit I of region R is used
+#define BITUSED(R,I)    (((R)->bitmap[(I)/64]>>((I)%64))&1)
+
+/// Number of bits set in x
+static int32_t BitCount(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+int32_t n = 0;
+
+    while( x ) {
+        x &= x-1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/// First word of map from w on that is not equal to skip, or nwords
+static HWORD BitmapSkip(const uint64_t *map, HWORD w, HWORD nwords, uint64_t skip) {
+#ifdef BITVECWORDS
+BITVEC v = { 0 };
+
+    v += skip;
+    while( w+BITVECWORDS <= nwords && BITVECEQUAL(*(const BITVEC *) (map+w),v) )
+        w += BITVECWORDS;
+#endif
+    while( w < nwords && map[w] == skip )
+        w++;
+    return w;
+}
+
+/**
+ *  @brief  First unit from unit i on that is free (skip BITSSET) or used
+ *          (skip BITSCLEAR), or bitunits when there is none
+ */
+static HWORD BitmapFind(REGION *r, HWORD i, uint64_t skip) {
+uint64_t x;
+HWORD w;
+
+    if( i >= r->bitunits )
+        return r->bitunits;
+    w = i/64;
+    x = (r->bitmap[w]^skip)&(BITSSET<<(i%64));
+    if( !x ) {
+        w = BitmapSkip(r->bitmap,w+1,r->bitwords,skip);
+        if( w == r->bitwords )
+            return r->bitunits;
+        x = r->bitmap[w]^skip;
+    }
+    i = w*64+BitLow(x);
+    return i < r->bitunits ? i : r->bitunits;
+}
+
+#define BITMAPFREE(R,I) BitmapFind(R,I,BITSSET)
+#define BITMAPUSED(R,I) BitmapFind(R,I,BITSCLEAR)
+
+/// Set (used not zero) or clear the bits of n units, at least one, from unit i
+static void BitmapFill(REGION *r, HWORD i, HWORD n, int32_t used) {
+uint64_t mask;
+HWORD w, last;
+
+    last = (i+n-1)/64;
+    for(w=i/64;w<=last;w++) {
+        mask = BITSSET;
+        if( w == i/64 )
+            mask &= BITSSET<<(i%64);
+        if( w == last )
+            mask &= BITSSET>>(63-(i+n-1)%64);
+        if( used )
+            r->bitmap[w] |= mask;
+        else
+            r->bitmap[w] &= ~mask;
+    }
+}
+
+/// Make the n units from unit i a free run, with its header at both ends
+static void BitmapTag(REGION *r, HWORD i, HWORD n) {
+HEADER *b;
+
+    b = BLOCK(r->start,i);
+    b->word   = 0;
+    b->size   = n;
+    b->region = r->end->region;
+    BLOCK(b,n)[-1] = *b;
+}
+
+/**
+ *  @brief  Free units and free runs of region r, counted with popcounts
+ *
+ *  @note   A run starts at a clear bit after a set one. The unit before the
+ *          region counts as used.
+ */
+static void BitmapCount(REGION *r, HWORD *units, HWORD *runs) {
+uint64_t x, carry = 1;
+HWORD w;
+
+    *units = 0;
+    *runs  = 0;
+    for(w=0;w<r->bitwords;w++) {
+        x = r->bitmap[w];
+        *units += 64-BitCount(x);
+        *runs  += BitCount(~x&((x<<1)|carry));
+        carry = x>>63;
+    }
+}
+///@}
+
+/**
+ *  @brief  Initialize a bitmap region with an area
+ *
+ *  @note   If the region is already initialized, does nothing
+ */
+static void BitmapAddArea(REGION *r, uint32_t region, void *area, size_t size) {
+uintptr_t start, end, nunits, nwords, w;
+
+    if( r->start )
+        return;
+
+    /* Bitmap for all units of the area, then the first block */
+    start = ((uintptr_t) area+sizeof(uint64_t)-1)&~(uintptr_t)(sizeof(uint64_t)-1);
+    end   = ((uintptr_t) area+size)&~(uintptr_t)(MEM_UNIT-1);
+    if( end <= start )
+        return;
+    nwords = (end-start)/MEM_UNIT/64+1;
+    r->bitmap = (uint64_t *) start;
+    start = (start+nwords*sizeof(uint64_t)+sizeof(HEADER)+MEM_UNIT-1)&~(uintptr_t)(MEM_UNIT-1);
+    if( end <= start )
+        return;
+    nunits = (end-start)/MEM_UNIT;
+    if( nunits > MAXUNITS ) {
+        nunits = MAXUNITS;
+        end = start+nunits*MEM_UNIT;
+    }
+
+    r->start = (HEADER *) start - 1;
+    r->end   = (HEADER *) end - 1;
+    r->type  = MEM_REGION_BITMAP;
+    r->bitunits = nunits;
+    r->bitwords = (nunits+63)/64;
+    r->bitfirst = 0;
+    r->memleft  = nunits;
+    r->memsize  = nunits;
+#ifdef MEM_TRIM_THRESHOLD
+    r->trimmark = r->memleft;
+#endif
+
+    for(w=0;w<r->bitwords;w++)
+        r->bitmap[w] = BITSCLEAR;
+    if( nunits%64 )
+        r->bitmap[r->bitwords-1] = BITSSET<<(nunits%64);
+    r->end->word   = 0;
+    r->end->used   = 1;
+    r->end->region = region;
+    BitmapTag(r,0,nunits);
+}
+
+/**
+ *  @brief  BitmapAlloc
+ *
+ *  @note   Returns the header of an allocated block with nelems units from
+ *          the first free run long enough, or NULL. The units after the block
+ *          are left as a shorter run.
+ *
+ *  @note   The bitmap is scanned a word at a time. A run that ends in a word
+ *          is long enough when its units in the previous words and its clear
+ *          bits at the start of the word are. Shorter runs inside the word
+ *          are found combining its clear bits with shifted copies. Words with
+ *          all units used are skipped, and all units before bitfirst are used.
+ *
+ *  @note   Lock of the region must be held
+ */
+static HEADER *BitmapAlloc(REGION *r, HWORD nelems) {
+HEADER *block;
+uint64_t x, m;
+HWORD w, i, j, k, s, carry;
+
+    r->bitfirst = BITMAPFREE(r,r->bitfirst);
+    i = r->bitunits;
+    carry = 0;
+    for(w=r->bitfirst/64;w<r->bitwords;w++) {
+        x = r->bitmap[w];
+        if( x == BITSSET ) {
+            w = BitmapSkip(r->bitmap,w,r->bitwords,BITSSET)-1;
+            carry = 0;
+            continue;
+        }
+        if( carry+(x ? (HWORD) BitLow(x) : 64) >= nelems ) {
+            i = w*64-carry;
+            break;
+        }
+        if( nelems < 64 ) {
+            m = ~x;
+            for(k=1;k<nelems && m;k+=s) {
+                s = k < nelems-k ? k : nelems-k;
+                m &= m>>s;
+            }
+            if( m ) {
+                i = w*64+BitLow(m);
+                break;
+            }
+        }
+        carry = x ? (HWORD) (63-BitHigh(x)) : carry+64;
+    }
+    if( i >= r->bitunits )
+        return NULL;
+
+    /* i starts a run, whose size is in its header */
+    j = i+BLOCK(r->start,i)->size;
+    BitmapFill(r,i,nelems,1);
+    if( j-i > nelems )
+        BitmapTag(r,i+nelems,j-i-nelems);
+    block = BLOCK(r->start,i);
+    block->word   = 0;
+    block->size   = nelems;
+    block->used   = 1;
+    block->region = r->end->region;
+
+    r->memleft -= nelems;
+    r->usedblocks++;
+    r->allocs++;
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+    return block;
+}
+
+/**
+ *  @brief  BitmapFree
+ *
+ *  @note   Clears the bits of the used block f and combines it with the free
+ *          runs around it, whose sizes are in the headers at their ends
+ *
+ *  @note   Lock of the region must be held
+ */
+static void BitmapFree(REGION *r, HEADER *f) {
+HWORD i, n;
+
+    r->memleft += f->size;
+    r->usedblocks--;
+    r->frees++;
+
+    i = BITUNIT(r,f);
+    n = f->size;
+    BitmapFill(r,i,n,0);
+    if( i+n < r->bitunits && !BITUSED(r,i+n) )
+        n += BLOCK(f,n)->size;
+    if( i > 0 && !BITUSED(r,i-1) ) {
+        i -= f[-1].size;
+        n += f[-1].size;
+    }
+    if( i < r->bitfirst )
+        r->bitfirst = i;
+    BitmapTag(r,i,n);
+}
+
+/**
+ *  @brief  BitmapResize
+ *
+ *  @note   Shrinks the used block f to nelems units, or grows it into the
+ *          free run after it. Returns -1 when that run is too short.
+ *
+ *  @note   Lock of the region must be held
+ */
+static int32_t BitmapResize(REGION *r, HEADER *f, HWORD nelems) {
+HWORD i, end;
+
+    /* End of the block and of the free run after it */
+    i   = BITUNIT(r,f);
+    end = i+f->size;
+    if( end < r->bitunits && !BITUSED(r,end) )
+        end += NEXTBLOCK(f)->size;
+    if( nelems > end-i )
+        return -1;
+
+    if( nelems > f->size )
+        BitmapFill(r,i+f->size,nelems-f->size,1);
+    else if( nelems < f->size )
+        BitmapFill(r,i+nelems,f->size-nelems,0);
+    r->memleft = r->memleft+f->size-nelems;
+    f->size = nelems;
+    if( end > i+nelems ) {
+        BitmapTag(r,i+nelems,end-i-nelems);
+        if( i+nelems < r->bitfirst )
+            r->bitfirst = i+nelems;
+    }
+
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+    return 0;
+}
+
+#endif
+
+#ifdef MEM_SLAB
+
+/**
+ *  @brief  Slabs
+ *
+ *  @note   A slab without used objects goes to the empty list, so it can get
+ *          another size. Slabs with free objects are in a doubly linked list
+ *          for their size, and a full slab is in no list.
+ */
+///@{
+/// Bytes of the slab header, before the first object
+#define SLABHEAD        ((sizeof(SLAB)+MEM_UNIT-1)&~(size_t)(MEM_UNIT-1))
+/// Slab of object P
+#define SLABOF(P)       ((SLAB *)((uintptr_t)(P)&~(uintptr_t)(MEM_SLAB_BYTES-1)))
+/// Not zero when slab S has no free object and no room for another one
+#define SLABFULL(S)     (!(S)->free && (S)->unused+(S)->size > (char *)(S)+MEM_SLAB_BYTES)
+
+/// Regions with slabs, for MemFree to find the slab of an object
+static REGION *SlabRegions[MEM_NREGIONS];
+static uint32_t NSlabRegions;
+
+/// Region whose slabs hold p, or NULL when p has a header
+static REGION *SlabRegion(void *p) {
+uint32_t i;
+
+    for(i=0;i<NSlabRegions;i++) {
+        if( (char *) p >= SlabRegions[i]->slabstart && (char *) p < SlabRegions[i]->slabend )
+            return SlabRegions[i];
+    }
+    return NULL;
+}
+///@}
+
+/**
+ *  @brief  Add an area of slabs to region r
+ *
+ *  @note   If the region already has slabs, does nothing
+ */
+static void SlabAddArea(REGION *r, void *area, size_t size) {
+uintptr_t start, end;
+
+    if( r->slabstart )
+        return;
+    start = ((uintptr_t) area+MEM_SLAB_BYTES-1)&~(uintptr_t)(MEM_SLAB_BYTES-1);
+    end   = ((uintptr_t) area+size)&~(uintptr_t)(MEM_SLAB_BYTES-1);
+    if( end <= start )
+        return;
+    r->slabstart = (char *) start;
+    r->slabend   = (char *) end;
+    r->slabtop   = (char *) start;
+    SlabRegions[NSlabRegions++] = r;
+}
+
+/**
+ *  @brief  SlabAlloc
+ *
+ *  @note   Returns an object of at least nb bytes, at most MEM_SLAB_MAX, or
+ *          NULL when all slabs are used
+ *
+ *  @note   Lock of the region must be held
+ */
+static void *SlabAlloc(REGION *r, size_t nb) {
+SLAB *s;
+void *p;
+uint32_t c;
+
+    c = nb ? (nb+MEM_UNIT-1)/MEM_UNIT : 1;
+    s = r->slabs[c];
+    if( !s ) {
+        /* An empty slab, or one never used, gets the size */
+        if( r->slabempty ) {
+            s = r->slabempty;
+            r->slabempty = s->next;
+        } else if( r->slabtop < r->slabend ) {
+            s = (SLAB *) r->slabtop;
+            r->slabtop += MEM_SLAB_BYTES;
+        } else {
+            return NULL;
+        }
+        s->next   = NULL;
+        s->prev   = NULL;
+        s->free   = NULL;
+        s->unused = (char *) s+SLABHEAD;
+        s->size   = c*MEM_UNIT;
+        s->used   = 0;
+        r->slabs[c] = s;
+    }
+
+    if( s->free ) {
+        p = s->free;
+        s->free = *(void **) p;
+    } else {
+        p = s->unused;
+        s->unused += s->size;
+    }
+    s->used++;
+    if( SLABFULL(s) ) {
+        r->slabs[c] = s->next;
+        if( s->next )
+            s->next->prev = NULL;
+    }
+    r->slabobjects++;
+    r->slabbytes += s->size;
+    return p;
+}
+
+/**
+ *  @brief  SlabFree
+ *
+ *  @note   Returns the object p to its slab. A slab that was full goes back to
+ *          the list of its size, and a slab left without used objects goes to
+ *          the empty list.
+ *
+ *  @note   Lock of the region must be held
+ */
+static void SlabFree(REGION *r, void *p) {
+SLAB *s;
+uint32_t c;
+int32_t full;
+
+    s = SLABOF(p);
+    c = s->size/MEM_UNIT;
+    full = SLABFULL(s);
+    *(void **) p = s->free;
+    s->free = p;
+    s->used--;
+    r->slabobjects--;
+    r->slabbytes -= s->size;
+
+    if( s->used == 0 ) {
+        if( !full ) {
+            if( s->prev )
+                s->prev->next = s->next;
+            else
+                r->slabs[c] = s->next;
+            if( s->next )
+                s->next->prev = s->prev;
+        }
+        s->next = r->slabempty;
+        r->slabempty = s;
+    } else if( full ) {
+        s->prev = NULL;
+        s->next = r->slabs[c];
+        if( s->next )
+            s->next->prev = s;
+        r->slabs[c] = s;
+    }
+}
+
+/**
+ *  @brief  Free p when it is an object of a slab
+ *
+ *  @note   Returns 0 when p has a header
+ */
+static int32_t SlabRelease(void *p) {
+REGION *r;
+
+    r = SlabRegion(p);
+    if( !r )
+        return 0;
+    LOCK(r);
+    SlabFree(r,p);
+    UNLOCK(r);
+    return 1;
+}
+
+#endif
+
+/**
+ *  @brief  Initialize a region with an area
+ *
+ *  @note   If the region is already initialized, does nothing
+ */
+static void AddArea(REGION *r, uint32_t region, void *area, size_t size) {
+HEADER *first, *sentinel;
+uintptr_t start, end;
+uintptr_t nunits;
+
+    // If already initialized, do nothing
+    if( r->start )
+        return;
+
+    /* The area of the first block must be aligned to MEM_UNIT */
+    start = (uintptr_t) area + sizeof(HEADER);
+    start = ((start+MEM_UNIT-1)&~(uintptr_t)(MEM_UNIT-1)) - sizeof(HEADER);
+    end   = (uintptr_t) area + size;
+    if( end < start + sizeof(HEADER) )
+        return;
+    /* Room for the sentinel header */
+    nunits = (end - start - sizeof(HEADER))/MEM_UNIT;
+    if( nunits < MINBLOCK )
+        return;
+    /* The rest of a very large area is not used */
+    if( nunits > MAXUNITS )
+        nunits = MAXUNITS;
+
+    first = (HEADER *) start;
+    NEXTFREE(first)   = NULL;
+    first->size   = nunits;
+    first->used   = 0;
+    first->prevfree = 0;
+    first->region = region;
+
+    sentinel = NEXTBLOCK(first);
+    sentinel->size   = 0;
+    sentinel->used   = 1;
+    sentinel->prevfree = 0;
+    sentinel->region = region;
+
+    r->start = first;
+    r->end   = sentinel;
+
+#ifdef MEM_BINS
+    BinInsert(r,first);
+#else
+    r->free  = first;
+    r->freeblocks = 1;
+#ifdef MEM_NEXTFIT
+    r->rover = NULL;
+#endif
+#ifdef MEM_BOUNDARYTAGS
+    FREEPREV(first) = NULL;
+    TagFree(first);
+#endif
+#endif
+    r->memleft = first->size;
+    r->memsize = first->size;
+#ifdef MEM_TRIM_THRESHOLD
+    r->trimmark = r->memleft;
+#endif
+}
+
+
+/**
+ *  @brief  Add a region to the pool
+ *
+ *  @note   Area must be aligned to an uint32_t
+ *
+ *  @note   Some bytes at the start are lost to align the area of the blocks
+ *          to MEM_UNIT
+ *
+ *  @note   A region can not be larger than MAXUNITS units: 2 GBytes with the
+ *          32 bit header and the default MEM_UNIT, 1 GByte with MEM_INSTRUMENT.
+ *          With MEM_HEADER64 the limit is far beyond any address space.
+ */
+void
+MemAddRegion( uint32_t region, void *area, size_t size) {
+
+    MemAddRegionType(region,area,size,MEM_REGION_LIST);
+}
+
+
+/**
+ *  @brief  Add a region of a given type to the pool
+ *
+ *  @note   type is MEM_REGION_LIST, the free list organization of MemAddRegion,
+ *          MEM_REGION_BUDDY or MEM_REGION_BITMAP. A buddy region loses up to a
+ *          smallest block at the start to align its blocks and keeps its map
+ *          at the end of the area, and a bitmap region keeps its bitmap at the
+ *          start of the area.
+ *
+ *  @note   MEM_REGION_SLAB adds an area of slabs to the region, besides its
+ *          area of blocks, which can be added before or after. Slabs are added
+ *          before other threads free blocks, as MemFree reads the list of
+ *          regions with slabs without locking. The same holds for buddy
+ *          regions.
+ *
+ *  @note   Other types, and types whose option is not defined, are ignored
+ */
+void MemAddRegionType(uint32_t region, void *area, size_t size, uint32_t type) {
+REGION *r;
+
+    if( region >= MEM_NREGIONS )
+        return;
+
+    r = &Regions[region];
+
+    LOCK(r);
+    if( type == MEM_REGION_LIST )
+        AddArea(r,region,area,size);
+#ifdef MEM_BUDDY
+    else if( type == MEM_REGION_BUDDY )
+        BuddyAddArea(r,area,size);
+#endif
+#ifdef MEM_BITMAP
+    else if( type == MEM_REGION_BITMAP )
+        BitmapAddArea(r,region,area,size);
+#endif
+#ifdef MEM_SLAB
+    else if( type == MEM_REGION_SLAB )
+        SlabAddArea(r,area,size);
+#endif
+    UNLOCK(r);
+}
+
+
+/**
+ *  @brief  MemInit
+ *
+ *  @note   Initializes heap info
+ *
+ *  @note   There are two versions. A version without parameters, that uses
+ *          symbols defined by the linker. Another one, with explicit parameters.
+ *          The preprocessor symbol MEM_LINKERINIT chooses one
+ */
+#ifdef MEM_LINKERINIT
+void MemInit(void) {
+
+size_t size = (char *) &_heapend - (char *) &_heapstart;
+
+    MemAddRegion( 0, &_heapstart, size);
+
+}
+#else
+void MemInit(void *area, size_t size) {
+
+    MemAddRegion( 0, area, size);
+
+}
+#endif
+
+
+#ifndef MEM_BINS
+/**
+ *  @brief  Free a block whose place in the free list is after prev
+ *
+ *  @note   prev is NULL or a free block before f. Returns the free block that
+ *          now holds f, the prev of a block after f. So blocks in order of
+ *          address are freed in one sweep of the list.
+ *
+ *  @note   Lock of the region must be held
+ */
+static HEADER *BlockFreeAfter(REGION *r, HEADER *prev, HEADER *f) {
+HEADER *block;
+
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) ) {
+        BitmapFree(r,f);
+        return prev;
+    }
+#endif
+    r->memleft += f->size;
+    r->usedblocks--;
+    r->frees++;
+
+    for(block=prev?NEXTFREE(prev):r->free;block && block < f;prev=block,block=NEXTFREE(block))
+        ;
+    if( prev && NEXTBLOCK(prev) == f ) {
+        prev->size += f->size;
+        f = prev;
+    } else {
+        NEXTFREE(f) = block;
+#ifdef MEM_BOUNDARYTAGS
+        FREEPREV(f) = prev;
+        if( block )
+            FREEPREV(block) = f;
+#endif
+        if( prev )
+            NEXTFREE(prev) = f;
+        else
+            r->free = f;
+        f->used = 0;
+        r->freeblocks++;
+    }
+    if( block && NEXTBLOCK(f) == block ) {
+        f->size += block->size;
+        NEXTFREE(f) = NEXTFREE(block);
+#ifdef MEM_BOUNDARYTAGS
+        if( NEXTFREE(f) )
+            FREEPREV(NEXTFREE(f)) = f;
+#endif
+        r->freeblocks--;
+        ROVER(r,block,f);
+    }
+#ifdef MEM_BOUNDARYTAGS
+    TagFree(f);
+#endif
+    return f;
+}
+#endif
+
+
+/**
+ *  @brief  BlockFree
+ *
+ *  @note   Return memory to free list.
+ *          Where possible, make contiguous blocks of free memory.
+ *          Assumes that 0 is not a valid address for allocation. Also,
+ *          MemInit() must be called prior to using either MemFree() or MemAlloc();
+ *
+ *  @note   The Free List is kept in crescent order of address
+ *
+ *  @note   With MEM_SEGREGATED, the block is combined only with the following
+ *          one and put in the list of its size class
+ *
+ *  @note   With MEM_TLSF or MEM_BOUNDARYTAGS, the neighbours are found by the
+ *          boundary tags, so the block is combined with both without walking
+ *          any list. For first fit, the list is then doubly linked, and it is
+ *          only walked to find the place of a block without free neighbours.
+ *
+ *  @note   There are 4 case to consider:
+ *
+ *  Previous |  Next  | Action
+ *  ---------|--------|--------------------------
+ *   Busy    |  Busy  | Just add this block to free list
+ *   Free    |  Busy  | Add size to the previous block
+ *   Busy    |  Free  | Add size of the next block, add this block to list
+ *   Free    |  Free  | Add size of the next block and combine both to previous one
+ *
+ *  Attention: Do not forget the remove the combined blocks from free list
+ *
+ *  There are the limit cases to consider, start and end of area
+ */
+static void BlockFree(REGION *r, HEADER *f) {
+HEADER *nxt;
+#ifdef MEM_BOUNDARYTAGS
+HEADER *prv;
+#endif
+#ifndef MEM_BINS
+HEADER *block, *prev;
+#ifndef MEM_BOUNDARYTAGS
+HEADER *old;
+#endif
+#endif
+
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) ) {
+        BitmapFree(r,f);
+        return;
+    }
+#endif
+#if defined(MEM_NEXTFIT) && !defined(MEM_BOUNDARYTAGS)
+    /* The list before the rover is not walked */
+    if( r->rover && r->rover < f ) {
+        BlockFreeAfter(r,r->rover,f);
+        return;
+    }
+#endif
+
+    r->memleft += f->size;
+    r->usedblocks--;
+    r->frees++;
+
+#ifdef MEM_BINS
+#ifdef MEM_BOUNDARYTAGS
+    /*
+     * Combine with the previous block when it is free
+     */
+    if( f->prevfree ) {
+        prv = PREVBLOCK(f);
+        BinRemove(r,prv);
+        prv->size += f->size;
+        f = prv;
+    }
+#endif
+    /*
+     * Combine with the following block when it is free. Without boundary tags,
+     * the previous block is not known, so combining with it is left for
+     * BinConsolidate.
+     */
+    nxt = NEXTBLOCK(f);
+    if( !nxt->used ) {
+        BinRemove(r,nxt);
+        f->size += nxt->size;
+    }
+    BinInsert(r,f);
+    return;
+#elif defined(MEM_BOUNDARYTAGS)
+    /*
+     * The Free list in kept in crescent order of address. A free previous
+     * block keeps its place in the list, and a free next block is the
+     * following one in the list.
+     */
+    nxt = NEXTBLOCK(f);
+    if( f->prevfree ) {
+        prv = PREVBLOCK(f);
+        prv->size += f->size;
+        if( !nxt->used ) {
+            prv->size += nxt->size;
+            NEXTFREE(prv) = NEXTFREE(nxt);
+            if( NEXTFREE(prv) )
+                FREEPREV(NEXTFREE(prv)) = prv;
+            r->freeblocks--;
+            ROVER(r,nxt,prv);
+        }
+        TagFree(prv);
+        return;
+    }
+
+    /* A free next block gives its place in the list to the returnee */
+    if( !nxt->used ) {
+        f->size += nxt->size;
+        NEXTFREE(f) = NEXTFREE(nxt);
+        FREEPREV(f) = FREEPREV(nxt);
+        ROVER(r,nxt,f);
+    } else {
+#ifdef MEM_NEXTFIT
+        /* The list before the rover is not walked */
+        prev = r->rover && r->rover < f ? r->rover : NULL;
+        for(block=prev?NEXTFREE(prev):r->free;block && block < f;prev=block,block=NEXTFREE(block))
+            ;
+#else
+        for(prev=NULL,block=r->free;block && block < f;prev=block,block=NEXTFREE(block))
+            ;
+#endif
+        NEXTFREE(f) = block;
+        FREEPREV(f) = prev;
+        r->freeblocks++;
+    }
+    if( NEXTFREE(f) )
+        FREEPREV(NEXTFREE(f)) = f;
+    if( FREEPREV(f) )
+        NEXTFREE(FREEPREV(f)) = f;
+    else
+        r->free = f;
+    TagFree(f);
+    return;
+#else
+    /*
+     * The Free list in kept in crescent order of address.
+     *
+     * Free-space head is higher up in memory than returnee (or there is no
+     * free block at all). The returnee will be the new head
+     */
+    if ( !r->free || f < r->free ) {
+        old = r->free;                    /* Old head */
+        r->free = f;                        /* New head */
+        /* The only possibility is that the old head points to a contiguos block*/
+        nxt = NEXTBLOCK(f);                 /* Right after new head */
+
+        if (nxt == old) {                /* Old and new are contiguous. */
+            f->size += old->size;         /* Combine them    */
+            NEXTFREE(f) = NEXTFREE(old);          /* forming one block. */
+            ROVER(r,old,f);
+        } else {
+            NEXTFREE(f) = old;
+            r->freeblocks++;
+        }
+        f->used = 0;
+        return;
+    }
+
+    /*
+     * Otherwise, current free-space head is lower in memory. Walk down
+     * free-space list looking for the block being returned. If the next pointer
+     * points past the block, make a new entry and link it. If next pointer plus
+     * its size points to the block, form one contiguous block.
+     */
+
+    block = r->free;
+    prev = NULL;
+    while ( block && f > block  ) {
+        if (NEXTBLOCK(block) == f) {
+            block->size += f->size;     /* They're contiguous. */
+            f = NEXTBLOCK(block);     /* Form one block. */
+            if (f==NEXTFREE(block)) {
+                /*
+                 * The new, larger block is contiguous to the next free block,
+                 * so form a larger block. There's no need to continue this checking
+                 * since if the block following this free one
+                 * were free, the two would already have been combined.
+                 */
+                block->size += f->size;
+                NEXTFREE(block) = NEXTFREE(f);
+                block->used = 0;
+                r->freeblocks--;
+                ROVER(r,f,block);
+            }
+            return;
+        }
+        prev=block;
+        block=NEXTFREE(block);
+    }
+
+    /*
+     * The address of the block being returned is greater than one in
+     * the free queue (block) or the end of the queue was reached.
+     * If at end, just link to the end of the queue.
+     * Therefore, block is null or points to a block higher up in memory
+     * than the one being returned.
+     */
+    NEXTFREE(prev) = f;                 /* link to queue */
+    prev = NEXTBLOCK(f);             /* right after space to free */
+    if (prev == block) {            /* 'f' and 'block' are contiguous. */
+        f->size += block->size;
+        NEXTFREE(f) = NEXTFREE(block);         /* Form a larger, contiguous block. */
+        ROVER(r,block,f);
+    } else {
+        NEXTFREE(f) = block;
+        r->freeblocks++;
+    }
+    f->used = 0;
+    return;
+#endif
+}
+
+
+#ifdef MEM_REMOTEFREE
+
+/**
+ *  @brief  Remote free queue
+ *
+ *  @note   A thread freeing a block of a region whose last allocation was done
+ *          by another thread pushes it on the remote list of the region with a
+ *          single compare and swap, linked through its area. The blocks stay
+ *          marked as used until a thread holding the lock (usually the owner in
+ *          its next MemAlloc) takes the whole list and frees them.
+ *
+ *  @note   The address of a thread local variable identifies the thread
+ */
+static _Thread_local char RemoteSelf;
+
+/// Push a used block on the remote list of its region
+static void RemotePush(REGION *r, HEADER *f) {
+HEADER *head;
+
+    head = atomic_load_explicit(&r->remote,memory_order_relaxed);
+    do {
+        NEXTFREE(f) = head;
+    } while( !atomic_compare_exchange_weak_explicit(&r->remote,&head,f,
+                                memory_order_release,memory_order_relaxed) );
+}
+
+/// Free all blocks in the remote list. Lock of the region must be held
+static void RemoteDrain(REGION *r) {
+HEADER *b, *nxt;
+
+    if( !atomic_load_explicit(&r->remote,memory_order_relaxed) )
+        return;
+    b = atomic_exchange_explicit(&r->remote,NULL,memory_order_acquire);
+    while( b ) {
+        nxt = NEXTFREE(b);
+        UNREQUEST(r,b);
+        BlockFree(r,b);
+        b = nxt;
+    }
+}
+
+/// Mark the calling thread as owner of the region
+static void RemoteOwn(REGION *r) {
+
+    if( atomic_load_explicit(&r->owner,memory_order_relaxed) != &RemoteSelf )
+        atomic_store_explicit(&r->owner,&RemoteSelf,memory_order_relaxed);
+}
+
+/// Returns not zero when the calling thread is not the owner of the region
+static int32_t RemoteIsOther(REGION *r) {
+
+    return atomic_load_explicit(&r->owner,memory_order_relaxed) != &RemoteSelf;
+}
+
+#define DRAIN(R)        RemoteDrain(R)
+#else
+#define DRAIN(R)
+#endif
+
+#ifdef MEM_THREADCACHE
+#include <pthread.h>
+
+/**
+ *  @brief  Thread caches
+ *
+ *  @note   Each thread keeps, for each region, lists of blocks it freed with
+ *          up to MEM_CACHE_UNITS units, one list for each size. MemAlloc takes
+ *          a block with the exact size from them without locking the region.
+ *
+ *  @note   Cached blocks are still marked as used. When a list reaches
+ *          MEM_CACHE_LIMIT blocks, half of them go back to the region, under
+ *          a single lock. All blocks go back when the thread exits.
+ *
+ *  @note   With MEM_INSTRUMENT, a cached block taken for another number of
+ *          bytes changes the bytes requested from its region. The change is kept by the thread and
+ *          added to the region when the thread returns blocks to it or reads
+ *          its fragmentation.
+ */
+///@{
+#ifndef MEM_CACHE_UNITS
+#define MEM_CACHE_UNITS 32
+#endif
+#ifndef MEM_CACHE_LIMIT
+#define MEM_CACHE_LIMIT 32
+#endif
+
+typedef struct cacheclass {
+    HEADER      *first;                 ///< First cached block
+    uint32_t     count;                 ///< Number of cached blocks
+} CACHECLASS;
+
+static _Thread_local CACHECLASS Cache[NREGIONS][MEM_CACHE_UNITS+1];
+static pthread_key_t CacheKey;
+static pthread_once_t CacheOnce = PTHREAD_ONCE_INIT;
+///@}
+
+#ifdef MEM_INSTRUMENT
+static _Thread_local uint64_t CacheReqBytes[NREGIONS];
+
+/// Add the change of the bytes requested by the calling thread to region r
+static void CacheSync(REGION *r) {
+
+    r->reqbytes += CacheReqBytes[r-Regions];
+    CacheReqBytes[r-Regions] = 0;
+}
+#endif
+
+/**
+ *  @brief  Return up to n blocks of a cache list to region r
+ */
+static void CacheRelease(REGION *r, CACHECLASS *c, uint32_t n) {
+HEADER *b;
+
+    LOCK(r);
+#ifdef MEM_INSTRUMENT
+    CacheSync(r);
+#endif
+    while( n-- > 0 && c->first ) {
+        b = c->first;
+        c->first = NEXTFREE(b);
+        c->count--;
+        UNREQUEST(r,b);
+        BlockFree(r,b);
+    }
+    UNLOCK(r);
+}
+
+/**
+ *  @brief  Return all cached blocks of the calling thread
+ */
+static void CacheFlush(void *unused) {
+uint32_t i, j;
+
+    (void) unused;
+    for(i=0;i<NREGIONS;i++) {
+        for(j=0;j<=MEM_CACHE_UNITS;j++) {
+            if( Cache[i][j].first )
+                CacheRelease(&Regions[i],&Cache[i][j],Cache[i][j].count);
+        }
+    }
+}
+
+static void CacheKeyCreate(void) {
+
+    pthread_key_create(&CacheKey,CacheFlush);
+}
+
+/**
+ *  @brief  Region whose area holds the block f, or NULL
+ *
+ *  @note   The header of the block is not read. Regions only grow, and only
+ *          free blocks at their end are trimmed, so a used block is always
+ *          before the end of its region.
+ */
+static REGION *RegionOf(HEADER *f) {
+REGION *r;
+
+    for(r=Regions;r<Regions+NREGIONS;r++) {
+        if( r->start && f >= r->start && f < r->end )
+            return r;
+    }
+    return NULL;
+}
+
+/**
+ *  @brief  Put a used block of region r in the cache list for nelems units of
+ *          the calling thread. The block has at least nelems units.
+ *
+ *  @note   The header of the block is not read
+ */
+static void CachePut(REGION *r, HEADER *f, HWORD nelems) {
+CACHECLASS *c;
+
+    c = &Cache[r-Regions][nelems];
+    if( c->count == 0 ) {
+        /* So CacheFlush is called when the thread exits */
+        pthread_once(&CacheOnce,CacheKeyCreate);
+        pthread_setspecific(CacheKey,Cache);
+    }
+    NEXTFREE(f) = c->first;
+    c->first = f;
+    if( ++c->count >= MEM_CACHE_LIMIT )
+        CacheRelease(r,c,MEM_CACHE_LIMIT/2);
+}
+
+/**
+ *  @brief  Get a block with nelems units for nb bytes from the cache of the
+ *          calling thread
+ */
+static HEADER *CacheGet(uint32_t region, HWORD nelems, size_t nb) {
+CACHECLASS *c;
+HEADER *b;
+
+    c = &Cache[region][nelems];
+    b = c->first;
+    if( b ) {
+        c->first = NEXTFREE(b);
+        c->count--;
+#ifdef MEM_INSTRUMENT
+        CacheReqBytes[region] += nb-BlockRequested(b);
+        BlockSetRequest(b,nb);
+#endif
+    }
+#ifndef MEM_INSTRUMENT
+    (void) nb;
+#endif
+    return b;
+}
+
+#endif
+
+
+/**
+ *  @brief  MemFlushCache
+ *
+ *  @note   Returns the blocks cached by the calling thread to their regions.
+ *          Does nothing without MEM_THREADCACHE.
+ */
+void MemFlushCache(void) {
+
+#ifdef MEM_THREADCACHE
+    CacheFlush(NULL);
+#endif
+}
+
+
+/**
+ *  @brief  MemLockAll
+ *
+ *  @note   Takes the locks of all regions, so another thread can not be in
+ *          the middle of an allocation. It is called before fork, and
+ *          MemUnlockAll is called after it, in the parent and in the child.
+ *          Both do nothing without MEM_THREADS.
+ */
+void MemLockAll(void) {
+#ifdef MEM_THREADS
+uint32_t i;
+
+    for(i=0;i<NREGIONS;i++)
+        LOCK(&Regions[i]);
+#endif
+}
+
+void MemUnlockAll(void) {
+#ifdef MEM_THREADS
+int32_t i;
+
+    for(i=NREGIONS-1;i>=0;i--)
+        UNLOCK(&Regions[i]);
+#endif
+}
+
+
+/**
+ *  @brief  MemSize
+ *
+ *  @note   Returns the number of bytes that can be used in the block of p,
+ *          at least the number of bytes requested. With MEM_INSTRUMENT, the
+ *          bytes that hold the slack of the block are not counted.
+ */
+size_t MemSize(void *p) {
+HEADER *f;
+#ifdef MEM_BUDDY
+REGION *r;
+#endif
+
+    if( !p )
+        return 0;
+#ifdef MEM_SLAB
+    if( SlabRegion(p) )
+        return SLABOF(p)->size;
+#endif
+#ifdef MEM_BUDDY
+    if( (r = BuddyRegion(p)) != NULL )
+        return BuddySize(r,p);
+#endif
+    f = (HEADER *)p - 1;
+    return f->size*MEM_UNIT-sizeof(HEADER)-SLACKBYTES(f);
+}
+
+
+#ifdef MEM_TRIM
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ *  @brief  Trimming
+ *
+ *  @note   The pages entirely inside the area of a free block, after its links
+ *          and before its footer, are given back with madvise(MADV_DONTNEED).
+ *          They read as zeros when used again.
+ *
+ *  @note   A free block at the end of a growable region is shortened to the
+ *          first page boundary after its links, and the memory after it is
+ *          uncommitted.
+ *
+ *  @note   Only pages in memory (mincore) are counted as released, so pages
+ *          released before, or never used, are not counted again.
+ */
+static uintptr_t PageSize;
+
+#define PAGEUP(A)       (((uintptr_t)(A)+PageSize-1)&~(PageSize-1))
+#define PAGEDOWN(A)     ((uintptr_t)(A)&~(PageSize-1))
+
+/// Pages checked by a call to mincore
+#define TRIMPAGES       256
+
+/// Bytes in memory in the pages from start to end
+static size_t Resident(uintptr_t start, uintptr_t end) {
+unsigned char vec[TRIMPAGES];
+uintptr_t len;
+size_t resident = 0;
+uint32_t i, n;
+
+    for(;start<end;start+=len) {
+        len = end-start;
+        if( len > TRIMPAGES*PageSize )
+            len = TRIMPAGES*PageSize;
+        if( mincore((void *) start,len,vec) != 0 )
+            return resident+(end-start);
+        n = len/PageSize;
+        for(i=0;i<n;i++) {
+            if( vec[i]&1 )
+                resident += PageSize;
+        }
+    }
+    return resident;
+}
+
+/// Release the pages from start to end. Returns the number of bytes
+static size_t TrimArea(void *from, void *to) {
+uintptr_t start, end;
+size_t resident;
+
+    start = PAGEUP(from);
+    end   = PAGEDOWN(to);
+    if( start >= end )
+        return 0;
+    resident = Resident(start,end);
+    if( resident == 0 || madvise((void *) start,end-start,MADV_DONTNEED) != 0 )
+        return 0;
+    return resident;
+}
+
+/// Release the pages inside the free block b. Returns the number of bytes
+static size_t TrimBlock(HEADER *b) {
+
+    return TrimArea((char *)(b+1)+sizeof(FREELINK),(char *)NEXTBLOCK(b)-sizeof(HEADER));
+}
+
+#ifdef MEM_GROWABLE
+/// Shorten the free block b at the end of r and uncommit the rest
+static size_t TrimTail(REGION *r, HEADER *b) {
+HEADER *sentinel;
+char *commit;
+size_t released;
+
+    commit = (char *) PAGEUP(BLOCK(b,MINBLOCK)+1);
+    if( !r->limit || commit >= r->commit )
+        return 0;
+
+#ifdef MEM_BINS
+    BinRemove(r,b);
+#endif
+    r->memleft -= b->size;
+    r->memsize -= b->size;
+    b->size = ((uintptr_t) commit - (uintptr_t) b - sizeof(HEADER))/MEM_UNIT;
+    r->memleft += b->size;
+    r->memsize += b->size;
+
+    sentinel = NEXTBLOCK(b);
+    sentinel->size   = 0;
+    sentinel->used   = 1;
+    sentinel->prevfree = 0;
+    sentinel->region = b->region;
+    r->end = sentinel;
+#ifdef MEM_BINS
+    BinInsert(r,b);
+#elif defined(MEM_BOUNDARYTAGS)
+    TagFree(b);
+#endif
+
+    released = Resident((uintptr_t) commit,(uintptr_t) r->commit);
+    madvise(commit,r->commit-commit,MADV_DONTNEED);
+    mprotect(commit,r->commit-commit,PROT_NONE);
+    r->commit = commit;
+    return released;
+}
+#endif
+
+/**
+ *  @brief  Release the pages of all free blocks of region r
+ *
+ *  @note   Lock of the region must be held. Returns the number of bytes
+ *          released by this call.
+ */
+static size_t RegionTrim(REGION *r) {
+HEADER *b, *tail = NULL;
+size_t released = 0;
+#if (defined(MEM_BINS) && !defined(MEM_BESTFIT)) || defined(MEM_BUDDY)
+int32_t i;
+#endif
+#ifdef MEM_BUDDY
+char *q;
+#endif
+
+    if( !PageSize )
+        PageSize = sysconf(_SC_PAGESIZE);
+
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) ) {
+        /* Free blocks are in the lists, after their links */
+        for(i=0;i<MEM_SIZEBITS;i++) {
+            for(q=r->orders[i];q;q=BUDDYNEXT(q))
+                released += TrimArea(q+sizeof(FREELINK),q+(((size_t)1)<<i)*MEM_UNIT);
+        }
+#ifdef MEM_TRIM_THRESHOLD
+        r->trimmark = r->memleft;
+#endif
+        return released;
+    }
+#endif
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) ) {
+        /* These regions do not grow, so there is no tail to uncommit */
+        for(b=r->start;b!=r->end;b=NEXTBLOCK(b)) {
+            if( !b->used )
+                released += TrimBlock(b);
+        }
+#ifdef MEM_TRIM_THRESHOLD
+        r->trimmark = r->memleft;
+#endif
+        return released;
+    }
+#endif
+#ifdef MEM_BESTFIT
+    /* There is no list, so the blocks are walked */
+    for(b=r->start;b!=r->end;b=NEXTBLOCK(b)) {
+        if( b->used )
+            continue;
+        if( NEXTBLOCK(b) == r->end )
+            tail = b;
+        else
+            released += TrimBlock(b);
+    }
+#elif defined(MEM_BINS)
+#ifndef MEM_BOUNDARYTAGS
+    BinConsolidate(r);
+#endif
+    for(i=0;i<MEM_NBINS;i++) {
+        for(b=r->bins[i];b;b=NEXTFREE(b)) {
+            if( NEXTBLOCK(b) == r->end )
+                tail = b;
+            else
+                released += TrimBlock(b);
+        }
+    }
+#else
+    for(b=r->free;b;b=NEXTFREE(b)) {
+        if( NEXTBLOCK(b) == r->end )
+            tail = b;
+        else
+            released += TrimBlock(b);
+    }
+#endif
+    if( tail ) {
+#ifdef MEM_GROWABLE
+        released += TrimTail(r,tail);
+#endif
+        released += TrimBlock(tail);
+    }
+#ifdef MEM_TRIM_THRESHOLD
+    r->trimmark = r->memleft;
+#endif
+    return released;
+}
+
+#ifdef MEM_TRIM_THRESHOLD
+#define TRIM(R)         do { if( (R)->memleft >= (R)->trimmark+MEM_TRIM_THRESHOLD/MEM_UNIT ) \
+                                RegionTrim(R); } while(0)
+#else
+#define TRIM(R)
+#endif
+#else
+#define TRIM(R)
+#endif
+
+
+/**
+ *  @brief  MemTrim
+ *
+ *  @note   Returns the pages of the free blocks of a region to the system.
+ *          Returns the number of bytes released, not counting pages that were
+ *          already released. Does nothing without MEM_TRIM.
+ *
+ *  @note   With MEM_TRIM_THRESHOLD, MemFree trims the region when its free
+ *          memory grew by that many bytes since the last trim or the lowest
+ *          point after it.
+ */
+size_t MemTrim(uint32_t region) {
+#ifdef MEM_TRIM
+REGION *r;
+size_t released;
+
+    if( region >= MEM_NREGIONS )
+        return 0;
+    r = &Regions[region];
+    if( !r->start )
+        return 0;
+
+    LOCK(r);
+    DRAIN(r);
+    released = RegionTrim(r);
+    UNLOCK(r);
+    return released;
+#else
+    (void) region;
+    return 0;
+#endif
+}
+
+
+#ifdef MEM_BUDDY
+/**
+ *  @brief  Free p when it is a block of a buddy region
+ *
+ *  @note   Returns 0 when p is not in a buddy region. The block goes neither
+ *          to the thread cache nor to the remote list, as it has no header.
+ */
+static int32_t BuddyRelease(void *p) {
+REGION *r;
+
+    r = BuddyRegion(p);
+    if( !r )
+        return 0;
+    LOCK(r);
+    BuddyFree(r,p);
+    TRIM(r);
+    UNLOCK(r);
+    return 1;
+}
+#endif
+
+
+/**
+ *  @brief  FreeBlock
+ *
+ *  @note   Frees the used block f, or puts it in the cache list for nelems
+ *          units. The block has at least nelems units.
+ */
+static void FreeBlock(HEADER *f, HWORD nelems) {
+REGION *r;
+
+    // Get region used for allocation
+    r = &Regions[f->region];
+
+#ifdef MEM_REMOTEFREE
+    if( f->used && RemoteIsOther(r) ) {
+        RemotePush(r,f);
+        return;
+    }
+#endif
+#ifdef MEM_THREADCACHE
+    if( f->used && nelems <= MEM_CACHE_UNITS ) {
+        CachePut(r,f,nelems);
+        return;
+    }
+#else
+    (void) nelems;
+#endif
+
+    LOCK(r);
+    DRAIN(r);
+    // Already free blocks are ignored
+    if( f->used ) {
+        UNREQUEST(r,f);
+        BlockFree(r,f);
+        TRIM(r);
+    }
+    UNLOCK(r);
+}
+
+
+/**
+ *  @brief  MemFree
+ *
+ *  @note   Return memory to free list of the region where it was allocated.
+ *          Assumes that 0 is not a valid address for allocation. Also,
+ *          MemInit() must be called prior to using either MemFree() or MemAlloc();
+ *
+ *  @note   With MEM_THREADS, the lock of the region is held while the block is
+ *          returned.
+ *
+ *  @note   With MEM_THREADCACHE, small blocks go to the cache of the calling
+ *          thread instead. A block freed twice then corrupts the cache.
+ *
+ *  @note   With MEM_REMOTEFREE, a block of a region owned by another thread is
+ *          pushed on the remote list of the region, without locking.
+ *
+ *  @note   Slab objects and blocks of buddy regions have no header. They are
+ *          found by address and freed with the lock of their region.
+ */
+#ifdef MEM_INSTRUMENT
+static void Free(void *p) {
+#else
+void MemFree(void *p) {
+#endif
+HEADER *f;
+
+    if( !p )
+        return;
+#ifdef MEM_SLAB
+    if( SlabRelease(p) )
+        return;
+#endif
+#ifdef MEM_BUDDY
+    if( BuddyRelease(p) )
+        return;
+#endif
+
+    f = (HEADER *)p - 1;                /* Point to header of block being returned. */
+#ifdef DEBUG
+    printf("Freeing element at %p with %lu elements and area at %p\n",f,(unsigned long) f->size,p);
+#endif
+    FreeBlock(f,f->size);
+}
+
+
+/**
+ *  @brief  MemFreeSized
+ *
+ *  @note   Frees the block of p, allocated or last resized with nb bytes.
+ *
+ *  @note   With MEM_THREADCACHE, a block of up to MEM_CACHE_UNITS units goes
+ *          to the cache list for nb bytes without reading its header: the
+ *          region is found from the address (RegionOf). That is where MemAlloc
+ *          looks for them, even when the block kept a few more units because
+ *          the rest was too small to split. The used bit is not checked, so a
+ *          block freed twice corrupts the cache, as with MemFree.
+ *
+ *  @note   Other blocks are freed as MemFree does, reading the header. Slab
+ *          objects and buddy blocks are found by address, as in MemFree.
+ *
+ *  @note   With DEBUG, nb is checked against the header, and the header is
+ *          used when they do not match.
+ */
+#ifdef MEM_INSTRUMENT
+static void FreeSized(void *p, size_t nb) {
+#else
+void MemFreeSized(void *p, size_t nb) {
+#endif
+HEADER *f;
+HWORD nelems;
+#ifdef MEM_THREADCACHE
+REGION *r;
+#endif
+
+    if( !p )
+        return;
+#ifdef MEM_SLAB
+    if( SlabRelease(p) )
+        return;
+#endif
+#ifdef MEM_BUDDY
+    if( BuddyRelease(p) )
+        return;
+#endif
+
+    f = (HEADER *)p - 1;
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+#ifdef DEBUG
+    printf("Freeing element at %p with %lu elements and area at %p\n",f,(unsigned long) nelems,p);
+    if( nb > (MAXUNITS-1)*MEM_UNIT || f->size < nelems
+        || f->size >= nelems+MINBLOCK ) {
+        printf("Size %zu does not match block with %lu elements\n",nb,(unsigned long) f->size);
+        nelems = f->size;
+    }
+#endif
+#ifdef MEM_THREADCACHE
+    if( nelems <= MEM_CACHE_UNITS && (r = RegionOf(f)) != NULL
+#ifdef MEM_REMOTEFREE
+        && !RemoteIsOther(r)
+#endif
+        ) {
+        CachePut(r,f,nelems);
+        return;
+    }
+#endif
+    FreeBlock(f,nelems);
+}
+
+
+/**
+ *  @brief  Sort pointers by address
+ *
+ *  @note   Heapsort, so no recursion and no additional memory
+ */
+static void SortPointers(void **v, size_t n) {
+size_t i, k, c;
+void *t;
+
+    for(i=n/2;i-->0;) {
+        for(k=i;(c=2*k+1)<n;k=c) {
+            if( c+1 < n && (uintptr_t) v[c+1] > (uintptr_t) v[c] )
+                c++;
+            if( (uintptr_t) v[k] >= (uintptr_t) v[c] )
+                break;
+            t = v[k]; v[k] = v[c]; v[c] = t;
+        }
+    }
+    while( n-- > 1 ) {
+        t = v[0]; v[0] = v[n]; v[n] = t;
+        for(k=0;(c=2*k+1)<n;k=c) {
+            if( c+1 < n && (uintptr_t) v[c+1] > (uintptr_t) v[c] )
+                c++;
+            if( (uintptr_t) v[k] >= (uintptr_t) v[c] )
+                break;
+            t = v[k]; v[k] = v[c]; v[c] = t;
+        }
+    }
+}
+
+
+/**
+ *  @brief  MemFreeBatch
+ *
+ *  @note   Frees count blocks. ptrs may contain NULL pointers and blocks of
+ *          different regions. It is sorted by address in place, so the caller
+ *          finds its pointers in another order. The lock of each region is
+ *          taken once.
+ *
+ *  @note   For first fit, the blocks are merged into the free list in one sweep
+ *          of it. With size classes, they are freed from the highest address
+ *          down, so adjacent blocks are combined even without boundary tags.
+ *
+ *  @note   The blocks do not go to the thread cache nor to the remote list.
+ *
+ *  @note   With MEM_SLAB, slab objects are freed first, one at a time, and
+ *          their pointers set to NULL. So are the blocks of buddy regions.
+ */
+#ifdef MEM_INSTRUMENT
+static void FreeBatch(void **ptrs, size_t count) {
+#else
+void MemFreeBatch(void **ptrs, size_t count) {
+#endif
+HEADER *f;
+REGION *r;
+uint32_t region;
+size_t i, j;
+#ifdef MEM_BINS
+size_t k;
+#else
+HEADER *prev;
+#endif
+
+#ifdef MEM_SLAB
+    /* Slab objects have no header with the region */
+    for(i=0;i<count;i++) {
+        if( ptrs[i] && SlabRelease(ptrs[i]) )
+            ptrs[i] = NULL;
+    }
+#endif
+#ifdef MEM_BUDDY
+    /* Nor buddy blocks */
+    for(i=0;i<count;i++) {
+        if( ptrs[i] && BuddyRelease(ptrs[i]) )
+            ptrs[i] = NULL;
+    }
+#endif
+    SortPointers(ptrs,count);
+    for(i=0;i<count && !ptrs[i];i++)
+        ;
+    while( i < count ) {
+        /* Regions do not overlap, so the blocks of a region are together */
+        region = ((HEADER *)ptrs[i]-1)->region;
+        for(j=i+1;j<count && ((HEADER *)ptrs[j]-1)->region == region;j++)
+            ;
+        r = &Regions[region];
+        LOCK(r);
+        DRAIN(r);
+#ifdef MEM_BINS
+        for(k=j;k-->i;) {
+            f = (HEADER *)ptrs[k] - 1;
+            if( f->used ) {
+                UNREQUEST(r,f);
+                BlockFree(r,f);
+            }
+        }
+#else
+        for(prev=NULL;i<j;i++) {
+            f = (HEADER *)ptrs[i] - 1;
+            if( f->used ) {
+                UNREQUEST(r,f);
+                prev = BlockFreeAfter(r,prev,f);
+            }
+        }
+#endif
+        TRIM(r);
+        UNLOCK(r);
+        i = j;
+    }
+}
+
+
+#ifdef MEM_GROWABLE
+#include <sys/mman.h>
+
+/**
+ *  @brief  Growable regions
+ *
+ *  @note   The address range of the region is reserved with no access. Memory
+ *          is committed in steps of MEM_GROW_CHUNK bytes from its start, so the
+ *          committed end is always page aligned.
+ *
+ *  @note   A region grows by turning its sentinel into the header of a new
+ *          block and placing a new sentinel at the end. Then the block is freed,
+ *          so it is combined with a free block at the end of the region.
+ */
+#ifndef MEM_GROW_CHUNK
+#define MEM_GROW_CHUNK  (64*1024)
+#endif
+
+/**
+ *  @brief  Commit memory for at least nelems units at the end of region r
+ *
+ *  @note   Lock of the region must be held. Returns 0 when the region grew.
+ */
+static int32_t RegionGrow(REGION *r, HWORD nelems) {
+HEADER *b, *sentinel;
+char *commit;
+uintptr_t need, nunits;
+
+    if( !r->limit )
+        return -1;
+
+    need = (uintptr_t) r->end + nelems*MEM_UNIT + sizeof(HEADER);
+    if( need > (uintptr_t) r->limit || need < (uintptr_t) r->end )
+        return -1;
+    commit = r->commit;
+    while( (uintptr_t) commit < need )
+        commit += MEM_GROW_CHUNK;
+    if( commit > r->limit )
+        commit = r->limit;
+
+    if( mprotect(r->commit,commit-r->commit,PROT_READ|PROT_WRITE) != 0 )
+        return -1;
+    r->commit = commit;
+
+    nunits = ((uintptr_t) commit - (uintptr_t) r->end - sizeof(HEADER))/MEM_UNIT;
+    b = r->end;
+    b->size = nunits;
+    b->used = 1;
+
+    sentinel = NEXTBLOCK(b);
+    sentinel->size   = 0;
+    sentinel->used   = 1;
+    sentinel->prevfree = 0;
+    sentinel->region = b->region;
+    r->end = sentinel;
+    r->memsize += nunits;
+
+    /* Freed as a used block, without counting it as freed */
+    r->usedblocks++;
+    BlockFree(r,b);
+    r->frees--;
+#ifdef MEM_TRIM_THRESHOLD
+    /* Committed memory is not a reason to trim */
+    r->trimmark += nunits;
+#endif
+    return 0;
+}
+
+#define GROW(R,N)       (RegionGrow(R,N) == 0)
+#else
+#define GROW(R,N)       0
+#endif
+
+
+/**
+ *  @brief  MemAddGrowableRegion
+ *
+ *  @note   Reserves reserve bytes of address space for region and commits the
+ *          first initial bytes. MemAlloc commits more memory when the region
+ *          has no free block large enough.
+ *
+ *  @note   Returns 0 on success. Returns -1 if the region is already
+ *          initialized, if the range can not be reserved or without
+ *          MEM_GROWABLE.
+ */
+int32_t MemAddGrowableRegion(uint32_t region, size_t reserve, size_t initial) {
+#ifdef MEM_GROWABLE
+REGION *r;
+char *area;
+size_t commit;
+int32_t rc = -1;
+
+    if( region >= MEM_NREGIONS )
+        return -1;
+    /* All the region must fit in a block */
+    if( reserve > (size_t) MAXUNITS*MEM_UNIT )
+        reserve = (size_t) MAXUNITS*MEM_UNIT;
+    if( initial > reserve )
+        initial = reserve;
+    commit = (initial+MEM_GROW_CHUNK-1)/MEM_GROW_CHUNK*MEM_GROW_CHUNK;
+    if( commit > reserve )
+        commit = reserve;
+
+    area = mmap(NULL,reserve,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if( area == MAP_FAILED )
+        return -1;
+    if( mprotect(area,commit,PROT_READ|PROT_WRITE) != 0 ) {
+        munmap(area,reserve);
+        return -1;
+    }
+
+    r = &Regions[region];
+    LOCK(r);
+    if( !r->start ) {
+        AddArea(r,region,area,commit);
+        if( r->start ) {
+            r->commit = area+commit;
+            r->limit  = area+reserve;
+            rc = 0;
+        }
+    }
+    UNLOCK(r);
+
+    if( rc != 0 )
+        munmap(area,reserve);
+    return rc;
+#else
+    (void) region;
+    (void) reserve;
+    (void) initial;
+    return -1;
+#endif
+}
+
+
+/**
+ *  @brief  BlockAlloc
+ *
+ *  @note   Returns the header of an allocated block with nelems units if found.
+ *          Otherwise, returns NULL
+ *
+ *  @note   It uses a first fit algorithm. With MEM_SEGREGATED or MEM_TLSF, the
+ *          block is taken from the smallest non empty size class where all
+ *          blocks fit. With MEM_NEXTFIT, the search starts where the last one
+ *          stopped and wraps around to the start of the list.
+ *
+ *  @note   Allocate the space requested plus space for the header of the block.
+ *          Search the free-space queue for a block that's large enough.
+ *          If block is larger than needed, break into two pieces
+ *          and allocate the portion higher up in memory.
+ *          Otherwise, just allocate the entire block.
+ *
+ */
+static HEADER *BlockAlloc(REGION *r, HWORD nelems) {
+HEADER *block;
+#ifndef MEM_BINS
+HEADER *prev;
+#endif
+#ifdef MEM_NEXTFIT
+int32_t wrapped;
+#endif
+
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) )
+        return BitmapAlloc(r,nelems);
+#endif
+#ifdef MEM_BINS
+    block = BinFind(r,nelems);
+#ifndef MEM_BOUNDARYTAGS
+    if( !block && BinConsolidate(r) )
+        block = BinFind(r,nelems);
+#endif
+    if( !block )
+        return NULL;
+
+    BinRemove(r,block);
+    if( block->size-nelems >= MINBLOCK ) {
+        block->size -= nelems;              /* Allocate tell end. */
+        BinInsert(r,block);
+        block = NEXTBLOCK(block);
+        block->size = nelems;
+    } else {
+        nelems = block->size;               /* Too small to split */
+    }
+#else
+#ifdef MEM_NEXTFIT
+    /* From the rover to the end, then from the start to the rover */
+    prev  = r->rover;
+    block = prev ? NEXTFREE(prev) : r->free;
+    wrapped = !prev;
+    for (;; prev=block,block = NEXTFREE(block)) {
+        if( !block && !wrapped ) {
+            wrapped = 1;
+            prev  = NULL;
+            block = r->free;
+        } else if( wrapped && prev && prev == r->rover ) {
+            block = NULL;
+        }
+        if( !block )
+            break;
+#else
+    for (prev=NULL,block=r->free; block!=NULL; prev=block,block = NEXTFREE(block)) {
+#endif
+        /* First fit */
+        if ( nelems <= block->size ) {        /* Big enough */
+            if ( block->size-nelems >= MINBLOCK ) {
+                block->size -= nelems;         /* Allocate tell end. */
+#ifdef MEM_BOUNDARYTAGS
+                TagFree(block);
+#endif
+                block = NEXTBLOCK(block);
+                block->size = nelems;         /* block now == pointer to be alloc'd. */
+            } else {
+                nelems = block->size;
+                if (prev==NULL) {
+                    r->free = NEXTFREE(block);
+                } else {
+                    NEXTFREE(prev) = NEXTFREE(block);
+                }
+                r->freeblocks--;
+#ifdef MEM_BOUNDARYTAGS
+                if( NEXTFREE(block) )
+                    FREEPREV(NEXTFREE(block)) = prev;
+#endif
+            }
+#ifdef MEM_NEXTFIT
+            r->rover = prev;            /* Next search starts here */
+#endif
+            break;
+        }
+    }
+
+    /* Area not found */
+    if( !block )
+        return NULL;
+#endif
+
+#ifdef MEM_BOUNDARYTAGS
+    TagUsed(block);
+#else
+    block->used   = 1;
+#endif
+    block->region = r - Regions;
+    r->memleft -= nelems;
+    r->usedblocks++;
+    r->allocs++;
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+
+    return block;
+}
+
+
+/**
+ *  @brief  BlockResize
+ *
+ *  @note   Changes the size of the used block f to nelems units without moving
+ *          it. Returns 0 on success, -1 when the following block is not free
+ *          or not large enough.
+ *
+ *  @note   A block shrinks by freeing its tail, when the tail is large enough
+ *          to be a block. A block grows by taking the free block that follows
+ *          it and giving back the units not needed. For first fit, the rest
+ *          takes the place of the free block in the list, which is kept in
+ *          order of address, so the list is walked only to find the previous
+ *          block when there are no boundary tags.
+ *
+ *  @note   Lock of the region must be held
+ */
+static int32_t BlockResize(REGION *r, HEADER *f, HWORD nelems) {
+HEADER *nxt, *rest;
+HWORD size;
+#ifndef MEM_BINS
+HEADER *prev, *next;
+#endif
+
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) )
+        return BitmapResize(r,f,nelems);
+#endif
+    if( nelems <= f->size ) {
+        if( f->size-nelems < MINBLOCK )
+            return 0;
+        rest = BLOCK(f,nelems);
+        rest->word   = 0;
+        rest->size   = f->size-nelems;
+        rest->used   = 1;
+        rest->region = f->region;
+        f->size = nelems;
+        /* Freed as a used block, without counting it as freed */
+        r->usedblocks++;
+        BlockFree(r,rest);
+        r->frees--;
+        return 0;
+    }
+
+    nxt = NEXTBLOCK(f);
+    if( nxt->used )
+        return -1;
+    size = f->size+nxt->size;
+    if( size < nelems )
+        return -1;
+    r->memleft -= nxt->size;
+
+    /* Unlink the free block before its links can be overwritten */
+#ifdef MEM_BINS
+    BinRemove(r,nxt);
+#else
+#ifdef MEM_BOUNDARYTAGS
+    prev = FREEPREV(nxt);
+#else
+    for(prev=NULL,next=r->free;next!=nxt;prev=next,next=NEXTFREE(next))
+        ;
+#endif
+    next = NEXTFREE(nxt);
+#endif
+
+    if( size-nelems >= MINBLOCK ) {
+        rest = BLOCK(f,nelems);
+        rest->word = 0;
+        rest->size = size-nelems;
+        f->size = nelems;
+        r->memleft += rest->size;
+#ifdef MEM_BINS
+        BinInsert(r,rest);
+#else
+        NEXTFREE(rest) = next;
+#ifdef MEM_BOUNDARYTAGS
+        FREEPREV(rest) = prev;
+        if( next )
+            FREEPREV(next) = rest;
+        TagFree(rest);
+#endif
+        if( prev )
+            NEXTFREE(prev) = rest;
+        else
+            r->free = rest;
+        ROVER(r,nxt,rest);
+#endif
+    } else {
+        f->size = size;
+#ifndef MEM_BINS
+        if( prev )
+            NEXTFREE(prev) = next;
+        else
+            r->free = next;
+#ifdef MEM_BOUNDARYTAGS
+        if( next )
+            FREEPREV(next) = prev;
+#endif
+        r->freeblocks--;
+        ROVER(r,nxt,prev);
+#endif
+    }
+#ifdef MEM_BOUNDARYTAGS
+    NEXTBLOCK(f)->prevfree = 0;
+#endif
+
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+    return 0;
+}
+
+
+/**
+ *  @brief  BlockAllocAligned
+ *
+ *  @note   Returns the header of an allocated block with nelems units whose
+ *          area is aligned to align bytes, a power of two larger than
+ *          MEM_UNIT. Otherwise, returns NULL
+ *
+ *  @note   A block with room for any offset is allocated. The units before the
+ *          aligned area are freed as a block of their own, so they must be
+ *          none or at least MINBLOCK, and the units after it are freed by
+ *          BlockResize.
+ *
+ *  @note   Lock of the region must be held
+ */
+static HEADER *BlockAllocAligned(REGION *r, HWORD nelems, size_t align) {
+HEADER *block, *aligned;
+HWORD lead, maxused;
+uintptr_t p, q;
+
+    maxused = r->maxused;
+    block = BlockAlloc(r,nelems+align/MEM_UNIT+MINBLOCK);
+    if( !block )
+        return NULL;
+
+    p = (uintptr_t) (block+1);
+    q = (p+align-1)&~(uintptr_t)(align-1);
+    while( q != p && (q-p)/MEM_UNIT < MINBLOCK )
+        q += align;
+    lead = (q-p)/MEM_UNIT;
+    if( lead > 0 ) {
+        aligned = BLOCK(block,lead);
+        aligned->word   = 0;
+        aligned->size   = block->size-lead;
+        aligned->used   = 1;
+        aligned->region = block->region;
+        block->size = lead;
+        /* Freed as a used block, without counting it as freed */
+        r->usedblocks++;
+        BlockFree(r,block);
+        r->frees--;
+        block = aligned;
+    }
+    BlockResize(r,block,nelems);
+
+    /* Only the units kept are counted as used */
+    r->maxused = maxused;
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+    return block;
+}
+
+
+/**
+ *  @brief  Split the area of size units at block, taken from the free list(s),
+ *          in k used blocks of nelems units for nb bytes
+ *
+ *  @note   The last block keeps the units that are left. Their areas are
+ *          stored in out. Returns k.
+ */
+static size_t BatchSplit(REGION *r, HEADER *block, HWORD size, HWORD nelems,
+                         HWORD k, size_t nb, void **out) {
+HWORD i;
+
+    r->memleft    -= size;
+    r->usedblocks += k;
+    r->allocs     += k;
+    if( r->memsize-r->memleft > r->maxused )
+        r->maxused = r->memsize-r->memleft;
+#ifdef MEM_TRIM_THRESHOLD
+    if( r->memleft < r->trimmark )
+        r->trimmark = r->memleft;
+#endif
+    for(i=0;i<k;i++) {
+        block->word   = 0;
+        block->size   = i+1 < k ? nelems : size;
+        block->used   = 1;
+        block->region = r - Regions;
+        size -= nelems;
+        REQUEST(r,block,nb);
+        out[i] = block+1;
+        block = NEXTBLOCK(block);
+    }
+#ifdef MEM_BOUNDARYTAGS
+    /* The block after the last one */
+    block->prevfree = 0;
+#endif
+    return k;
+}
+
+/**
+ *  @brief  BlockAllocBatch
+ *
+ *  @note   Allocates up to count blocks with nelems units for nb bytes and
+ *          stores their areas in out. Returns the number of blocks allocated.
+ *
+ *  @note   Blocks are carved from free spans, as many from each as fit, so the
+ *          free structure is walked once. For first fit, the list is swept and
+ *          the blocks come from the end of each free block large enough. With
+ *          size classes, the spans are taken from the highest class first.
+ *
+ *  @note   Free blocks are combined (MEM_SEGREGATED without boundary tags) and
+ *          a growable region grows at most once, and it only grows when not
+ *          even one block fits.
+ *
+ *  @note   Bitmap blocks are allocated one at a time.
+ *
+ *  @note   Lock of the region must be held
+ */
+static size_t BlockAllocBatch(REGION *r, size_t nb, HWORD nelems, size_t count, void **out) {
+HEADER *block;
+HWORD k;
+size_t n = 0;
+int32_t grown = 0;
+#ifdef MEM_BINS
+#ifndef MEM_BOUNDARYTAGS
+int32_t combined = 0;
+#endif
+#else
+HEADER *prev, *next;
+#endif
+
+    /* A span can not be split in blocks of any size */
+    if( ISBITMAP(r) ) {
+        for(;n<count && (block = BlockAlloc(r,nelems)) != NULL;n++) {
+            REQUEST(r,block,nb);
+            out[n] = block+1;
+        }
+        return n;
+    }
+
+#ifdef MEM_BINS
+    while( n < count ) {
+        block = BinLargest(r);
+        if( block && block->size < nelems )
+            block = BinFind(r,nelems);
+        if( !block ) {
+#ifndef MEM_BOUNDARYTAGS
+            if( !combined ) {
+                combined = 1;
+                if( BinConsolidate(r) )
+                    continue;
+            }
+#endif
+            k = count < MAXUNITS/nelems ? count : MAXUNITS/nelems;
+            if( n > 0 || grown || !GROW(r,k*nelems) )
+                break;
+            grown = 1;
+            continue;
+        }
+
+        BinRemove(r,block);
+        k = count-n < block->size/nelems ? count-n : block->size/nelems;
+        if( block->size-k*nelems >= MINBLOCK ) {
+            /* Carved from the end, the rest stays free */
+            block->size -= k*nelems;
+            n += BatchSplit(r,NEXTBLOCK(block),k*nelems,nelems,k,nb,out+n);
+            BinInsert(r,block);
+        } else {
+            n += BatchSplit(r,block,block->size,nelems,k,nb,out+n);
+        }
+    }
+#else
+    for(;;) {
+        for(prev=NULL,block=r->free;block && n<count;block=next) {
+            next = NEXTFREE(block);
+            if( block->size < nelems ) {
+                prev = block;
+                continue;
+            }
+            k = count-n < block->size/nelems ? count-n : block->size/nelems;
+            if( block->size-k*nelems >= MINBLOCK ) {
+                /* Carved from the end, the block stays in the list */
+                block->size -= k*nelems;
+                n += BatchSplit(r,NEXTBLOCK(block),k*nelems,nelems,k,nb,out+n);
+#ifdef MEM_BOUNDARYTAGS
+                TagFree(block);
+#endif
+                prev = block;
+            } else {
+                if( prev )
+                    NEXTFREE(prev) = next;
+                else
+                    r->free = next;
+#ifdef MEM_BOUNDARYTAGS
+                if( next )
+                    FREEPREV(next) = prev;
+#endif
+                r->freeblocks--;
+                ROVER(r,block,prev);
+                n += BatchSplit(r,block,block->size,nelems,k,nb,out+n);
+            }
+        }
+        k = count < MAXUNITS/nelems ? count : MAXUNITS/nelems;
+        if( n > 0 || grown || !GROW(r,k*nelems) )
+            break;
+        grown = 1;
+    }
+#endif
+    return n;
+}
+
+
+/**
+ *  @brief  MemAlloc
+ *
+ *  @note   Returns a pointer to an allocate memory block if found.
+ *          Otherwise, returns NULL
+ *
+ *  @note   With MEM_THREADS, the lock of the region is held while the block is
+ *          searched, so threads using different regions never wait.
+ *
+ *  @note   With MEM_THREADCACHE, a small block of the same size freed by the
+ *          calling thread is reused without locking.
+ *
+ *  @note   With MEM_REMOTEFREE, the calling thread becomes the owner of the
+ *          region, and blocks freed by other threads are freed first.
+ *
+ *  @note   With MEM_GROWABLE, a growable region commits more memory when no
+ *          free block is large enough.
+ *
+ *  @note   With MEM_SLAB, requests up to MEM_SLAB_MAX bytes are served by the
+ *          slabs of the region, when it has them, and by its blocks when all
+ *          slabs are used.
+ *
+ *  @note   A buddy region gives the smallest block of 2^k units that holds nb
+ *          bytes, without header, cache nor remote list.
+ */
+#ifdef MEM_INSTRUMENT
+static void *Alloc(size_t nb, uint32_t region) {
+#else
+void *MemAlloc(size_t nb, uint32_t region) {
+#endif
+HEADER *block;
+REGION *r;
+HWORD       nelems;
+#if defined(MEM_SLAB) || defined(MEM_BUDDY)
+void *p;
+#endif
+
+    if( region >= MEM_NREGIONS || nb > (MAXUNITS-1)*MEM_UNIT )
+        return NULL;
+
+    /* Add the header and round to a multiple of MEM_UNIT */
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+
+#ifdef DEBUG
+    printf("Allocating %zu bytes (=%lu elements)\n",nb,(unsigned long) nelems);
+#endif
+
+    r = &Regions[region];
+
+#ifdef MEM_SLAB
+    if( nb <= MEM_SLAB_MAX && r->slabstart ) {
+        LOCK(r);
+        p = SlabAlloc(r,nb);
+        UNLOCK(r);
+        if( p )
+            return p;
+    }
+#endif
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) ) {
+        LOCK(r);
+        p = BuddyAlloc(r,BUDDYNELEMS(nb));
+        UNLOCK(r);
+        return p;
+    }
+#endif
+#ifdef MEM_REMOTEFREE
+    RemoteOwn(r);
+#endif
+#ifdef MEM_THREADCACHE
+    if( nelems <= MEM_CACHE_UNITS && (block = CacheGet(region,nelems,nb)) != NULL )
+        return((void *)(block+1));
+#endif
+
+    LOCK(r);
+    DRAIN(r);
+    block = BlockAlloc(r,nelems);
+    if( !block && GROW(r,nelems) )
+        block = BlockAlloc(r,nelems);
+    if( block )
+        REQUEST(r,block,nb);
+    UNLOCK(r);
+
+    if( !block )
+        return NULL;
+
+    /*
+     * Return a pointer past the header to the actual space requested.
+     */
+    return((void *)(block+1));
+}
+
+
+#ifndef MEM_INSTRUMENT
+/// Allocation and free without counting in the histograms of MEM_INSTRUMENT
+#define Alloc           MemAlloc
+#define Free            MemFree
+#endif
+
+
+/**
+ *  @brief  MemAllocAligned
+ *
+ *  @note   Returns a pointer aligned to align bytes to a block of nb bytes, or
+ *          NULL when there is no memory or align is not a power of two. The
+ *          block is freed with MemFree.
+ *
+ *  @note   The aligned block is carved out of a free block and the slack
+ *          before and after it is returned to the free list(s), so nothing is
+ *          lost but the cost of the larger search. An alignment up to MEM_UNIT
+ *          is the one of MemAlloc. In a buddy region, a block of at least
+ *          align bytes is allocated, as blocks are aligned to their size.
+ *
+ *  @note   MemRealloc does not keep the alignment when it moves the block.
+ */
+#ifdef MEM_INSTRUMENT
+static void *AllocAligned(size_t nb, size_t align, uint32_t region) {
+#else
+void *MemAllocAligned(size_t nb, size_t align, uint32_t region) {
+#endif
+HEADER *block;
+REGION *r;
+HWORD nelems;
+#ifdef MEM_BUDDY
+void *p;
+#endif
+
+    if( (align&(align-1)) != 0 )
+        return NULL;
+    if( align <= MEM_UNIT )
+        return Alloc(nb,region);
+    if( region >= MEM_NREGIONS || nb > (MAXUNITS-1)*MEM_UNIT )
+        return NULL;
+
+    r = &Regions[region];
+
+#ifdef MEM_BUDDY
+    /* Blocks are aligned to their size */
+    if( ISBUDDY(r) ) {
+        if( align/MEM_UNIT > MAXUNITS )
+            return NULL;
+        nelems = BUDDYNELEMS(nb);
+        if( nelems < align/MEM_UNIT )
+            nelems = align/MEM_UNIT;
+        LOCK(r);
+        p = BuddyAlloc(r,nelems);
+        UNLOCK(r);
+        return p;
+    }
+#endif
+
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+    /* Room for any offset */
+    if( (size_t) nelems+align/MEM_UNIT+MINBLOCK > MAXUNITS )
+        return NULL;
+
+#ifdef MEM_REMOTEFREE
+    RemoteOwn(r);
+#endif
+
+    LOCK(r);
+    DRAIN(r);
+    block = BlockAllocAligned(r,nelems,align);
+    if( !block && GROW(r,nelems+align/MEM_UNIT+MINBLOCK) )
+        block = BlockAllocAligned(r,nelems,align);
+    if( block )
+        REQUEST(r,block,nb);
+    UNLOCK(r);
+
+    if( !block )
+        return NULL;
+    return((void *)(block+1));
+}
+
+
+/**
+ *  @brief  MemAllocBatch
+ *
+ *  @note   Allocates count blocks of nb bytes from region and stores the
+ *          pointers in out. Returns the number of blocks allocated, less than
+ *          count when there is no memory for the others.
+ *
+ *  @note   The blocks are carved from as few free blocks as possible with the
+ *          lock taken once, so they are usually adjacent. Each one is freed by
+ *          MemFree or MemFreeBatch.
+ *
+ *  @note   With MEM_SLAB, small objects are taken from the slabs first
+ *
+ *  @note   Blocks of a buddy region are allocated one at a time
+ */
+#ifdef MEM_INSTRUMENT
+static size_t AllocBatch(size_t nb, size_t count, uint32_t region, void **out) {
+#else
+size_t MemAllocBatch(size_t nb, size_t count, uint32_t region, void **out) {
+#endif
+REGION *r;
+HWORD nelems;
+size_t n = 0;
+
+    if( region >= MEM_NREGIONS || nb > (MAXUNITS-1)*MEM_UNIT || count == 0 )
+        return 0;
+
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+
+    r = &Regions[region];
+
+#ifdef MEM_REMOTEFREE
+    RemoteOwn(r);
+#endif
+
+    LOCK(r);
+#ifdef MEM_SLAB
+    if( nb <= MEM_SLAB_MAX && r->slabstart ) {
+        for(;n<count && (out[n] = SlabAlloc(r,nb)) != NULL;n++)
+            ;
+    }
+#endif
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) ) {
+        for(;n<count && (out[n] = BuddyAlloc(r,BUDDYNELEMS(nb))) != NULL;n++)
+            ;
+    }
+#endif
+    DRAIN(r);
+    if( n < count && !ISBUDDY(r) )
+        n += BlockAllocBatch(r,nb,nelems,count-n,out+n);
+    UNLOCK(r);
+
+    return n;
+}
+
+
+/**
+ *  @brief  Move the contents of p to a new block of nb bytes from region
+ *
+ *  @note   Returns the new pointer, or NULL when there is no memory, and then
+ *          p is not freed
+ */
+static void *MoveBlock(void *p, size_t nb, uint32_t region) {
+uintptr_t *src, *dst;
+size_t i, n;
+void *q;
+
+    q = Alloc(nb,region);
+    if( !q )
+        return NULL;
+    /* Both areas are aligned to MEM_UNIT, so words are copied first */
+    n = MemSize(p);
+    if( n > nb )
+        n = nb;
+    src = p;
+    dst = q;
+    for(i=0;i<n/sizeof(uintptr_t);i++)
+        dst[i] = src[i];
+    for(i*=sizeof(uintptr_t);i<n;i++)
+        ((char *)q)[i] = ((char *)p)[i];
+    Free(p);
+    return q;
+}
+
+
+/**
+ *  @brief  MemRealloc
+ *
+ *  @note   Changes the size of the block of p to nb bytes. Returns the new
+ *          pointer, or NULL when there is no memory, and then the block of p is
+ *          not changed. As for realloc, a NULL p allocates from region 0 and a
+ *          zero nb frees the block.
+ *
+ *  @note   The block is shrunk or grown in place when possible. A growable
+ *          region grows when the block is at its end. Otherwise, a new block is
+ *          allocated in the same region and the contents are copied. A block
+ *          of a buddy region only shrinks in place.
+ *
+ *  @note   A slab object stays in place while nb fits in it. Otherwise, it is
+ *          moved to the blocks of its region, or to another slab when nb is
+ *          still small.
+ */
+#ifdef MEM_INSTRUMENT
+static void *Realloc(void *p, size_t nb) {
+#else
+void *MemRealloc(void *p, size_t nb) {
+#endif
+HEADER *f, *nxt;
+REGION *r;
+HWORD nelems;
+#ifdef MEM_INSTRUMENT
+size_t old;
+#endif
+int32_t rc;
+
+    if( !p )
+        return Alloc(nb,0);
+    if( nb == 0 ) {
+        Free(p);
+        return NULL;
+    }
+    if( nb > (MAXUNITS-1)*MEM_UNIT )
+        return NULL;
+#ifdef MEM_SLAB
+    if( (r = SlabRegion(p)) != NULL )
+        return nb <= SLABOF(p)->size ? p : MoveBlock(p,nb,r-Regions);
+#endif
+#ifdef MEM_BUDDY
+    if( (r = BuddyRegion(p)) != NULL ) {
+        LOCK(r);
+        rc = BuddyResize(r,p,BUDDYNELEMS(nb));
+        UNLOCK(r);
+        return rc == 0 ? p : MoveBlock(p,nb,r-Regions);
+    }
+#endif
+
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+
+    f = (HEADER *)p - 1;
+    r = &Regions[f->region];
+
+    LOCK(r);
+    DRAIN(r);
+#ifdef MEM_INSTRUMENT
+    old = BlockRequested(f);
+#endif
+    UNREQUEST(r,f);
+    rc = BlockResize(r,f,nelems);
+    if( rc == 0 ) {
+        TRIM(r);
+    } else {
+        /* At the end of the region, with or without a free block after it */
+        nxt = NEXTBLOCK(f);
+        if( !nxt->used )
+            nxt = NEXTBLOCK(nxt);
+        if( nxt == r->end && GROW(r,nelems-f->size) )
+            rc = BlockResize(r,f,nelems);
+    }
+#ifdef MEM_INSTRUMENT
+    BlockRequest(r,f,rc == 0 ? nb : old);
+#endif
+    UNLOCK(r);
+    if( rc == 0 )
+        return p;
+
+    return MoveBlock(p,nb,f->region);
+}
+
+
+#ifdef MEM_INSTRUMENT
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/**
+ *  @brief  Instrumentation
+ *
+ *  @note   MemAlloc and MemFree are wrappers around Alloc and Free that count
+ *          the size requested and the cycles (nanoseconds when there is no
+ *          cycle counter) spent in the histograms of the region. Without
+ *          MEM_INSTRUMENT, Alloc and Free are MemAlloc and MemFree.
+ *
+ *  @note   MemAllocAligned, MemAllocBatch and MemRealloc are counted as
+ *          allocations, and MemFreeSized, MemFreeBatch and MemRealloc to zero
+ *          bytes as frees. Each block of a batch is counted with the mean
+ *          cycles of the call. The calls they make to Alloc and Free are not
+ *          counted again.
+ *
+ *  @note   Bucket 0 counts the value 0 and bucket i the values in
+ *          [2^(i-1),2^i). The last bucket also counts larger values.
+ */
+///@{
+#ifdef MEM_THREADS
+typedef _Atomic uint64_t HISTCOUNT;
+#define HISTADD(C)      atomic_fetch_add_explicit(&(C),1,memory_order_relaxed)
+#define HISTADDN(C,N)   atomic_fetch_add_explicit(&(C),N,memory_order_relaxed)
+#else
+typedef uint64_t HISTCOUNT;
+#define HISTADD(C)      ((C)++)
+#define HISTADDN(C,N)   ((C) += (N))
+#endif
+
+typedef struct histograms {
+    HISTCOUNT   size[MEM_HISTBUCKETS];  ///< Bytes requested by the allocations
+    HISTCOUNT   alloc[MEM_HISTBUCKETS]; ///< Cycles of the allocations
+    HISTCOUNT   free[MEM_HISTBUCKETS];  ///< Cycles of the frees
+} HISTOGRAMS;
+
+static HISTOGRAMS Histograms[MEM_NREGIONS];
+///@}
+
+/// Region of the block, slab object or buddy block p
+static uint32_t HistRegion(void *p) {
+#if defined(MEM_SLAB) || defined(MEM_BUDDY)
+REGION *r;
+#endif
+
+#ifdef MEM_SLAB
+    if( (r = SlabRegion(p)) != NULL )
+        return r-Regions;
+#endif
+#ifdef MEM_BUDDY
+    if( (r = BuddyRegion(p)) != NULL )
+        return r-Regions;
+#endif
+    return ((HEADER *)p-1)->region;
+}
+
+static uint64_t HistCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+#endif
+}
+
+/// Bucket of value v
+static uint32_t HistBucket(uint64_t v) {
+uint32_t i;
+
+#if defined(__GNUC__)
+    i = v ? 64-__builtin_clzll(v) : 0;
+#else
+    for(i=0;v;v>>=1)
+        i++;
+#endif
+    return i < MEM_HISTBUCKETS ? i : MEM_HISTBUCKETS-1;
+}
+
+void *MemAlloc(size_t nb, uint32_t region) {
+uint64_t t;
+void *p;
+
+    t = HistCycles();
+    p = Alloc(nb,region);
+    t = HistCycles()-t;
+    if( region < MEM_NREGIONS ) {
+        HISTADD(Histograms[region].size[HistBucket(nb)]);
+        HISTADD(Histograms[region].alloc[HistBucket(t)]);
+    }
+    return p;
+}
+
+void MemFree(void *p) {
+uint64_t t;
+uint32_t region;
+
+    if( !p )
+        return;
+    region = HistRegion(p);
+    t = HistCycles();
+    Free(p);
+    t = HistCycles()-t;
+    HISTADD(Histograms[region].free[HistBucket(t)]);
+}
+
+void MemFreeSized(void *p, size_t nb) {
+uint64_t t;
+uint32_t region;
+
+    if( !p )
+        return;
+    region = HistRegion(p);
+    t = HistCycles();
+    FreeSized(p,nb);
+    t = HistCycles()-t;
+    HISTADD(Histograms[region].free[HistBucket(t)]);
+}
+
+void *MemAllocAligned(size_t nb, size_t align, uint32_t region) {
+uint64_t t;
+void *p;
+
+    t = HistCycles();
+    p = AllocAligned(nb,align,region);
+    t = HistCycles()-t;
+    if( region < MEM_NREGIONS ) {
+        HISTADD(Histograms[region].size[HistBucket(nb)]);
+        HISTADD(Histograms[region].alloc[HistBucket(t)]);
+    }
+    return p;
+}
+
+void *MemRealloc(void *p, size_t nb) {
+uint64_t t;
+uint32_t region;
+void *q;
+
+    region = p ? HistRegion(p) : 0;
+    t = HistCycles();
+    q = Realloc(p,nb);
+    t = HistCycles()-t;
+    if( p && nb == 0 ) {
+        HISTADD(Histograms[region].free[HistBucket(t)]);
+    } else {
+        HISTADD(Histograms[region].size[HistBucket(nb)]);
+        HISTADD(Histograms[region].alloc[HistBucket(t)]);
+    }
+    return q;
+}
+
+size_t MemAllocBatch(size_t nb, size_t count, uint32_t region, void **out) {
+uint64_t t;
+size_t n;
+
+    t = HistCycles();
+    n = AllocBatch(nb,count,region,out);
+    t = HistCycles()-t;
+    if( region < MEM_NREGIONS && n ) {
+        HISTADDN(Histograms[region].size[HistBucket(nb)],n);
+        HISTADDN(Histograms[region].alloc[HistBucket(t/n)],n);
+    }
+    return n;
+}
+
+void MemFreeBatch(void **ptrs, size_t count) {
+size_t nfree[MEM_NREGIONS];
+size_t i, n = 0;
+uint64_t t;
+uint32_t region, bucket;
+
+    /* The regions are read before the blocks are freed */
+    for(region=0;region<MEM_NREGIONS;region++)
+        nfree[region] = 0;
+    for(i=0;i<count;i++) {
+        if( ptrs[i] ) {
+            nfree[HistRegion(ptrs[i])]++;
+            n++;
+        }
+    }
+    t = HistCycles();
+    FreeBatch(ptrs,count);
+    t = HistCycles()-t;
+    if( n == 0 )
+        return;
+    bucket = HistBucket(t/n);
+    for(region=0;region<MEM_NREGIONS;region++) {
+        if( nfree[region] )
+            HISTADDN(Histograms[region].free[bucket],nfree[region]);
+    }
+}
+#endif
+
+
+/**
+ *  @brief  MemHistogram
+ *
+ *  @note   Copies the histograms of a region. They are all zeros without
+ *          MEM_INSTRUMENT.
+ */
+void MemHistogram( MEMHIST *hist, uint32_t region ) {
+uint32_t i;
+
+    for(i=0;i<MEM_HISTBUCKETS;i++) {
+        hist->size[i]  = 0;
+        hist->alloc[i] = 0;
+        hist->free[i]  = 0;
+    }
+#ifdef MEM_INSTRUMENT
+    if( region >= MEM_NREGIONS )
+        return;
+    for(i=0;i<MEM_HISTBUCKETS;i++) {
+        hist->size[i]  = Histograms[region].size[i];
+        hist->alloc[i] = Histograms[region].alloc[i];
+        hist->free[i]  = Histograms[region].free[i];
+    }
+#else
+    (void) region;
+#endif
+}
+
+
+/**
+ *  @brief  Copy the counters of region r to stats
+ *
+ *  @note   Lock of the region must be held
+ */
+static void StatsCounters(MEMSTATS *stats, REGION *r) {
+#ifdef MEM_BITMAP
+HWORD units, runs;
+#endif
+
+    stats->memleft      = r->memleft*MEM_UNIT;
+    stats->freebytes    = r->memleft*MEM_UNIT;
+    stats->usedbytes    = (r->memsize-r->memleft)*MEM_UNIT;
+    stats->freeblocks   = r->freeblocks;
+    stats->usedblocks   = r->usedblocks;
+    stats->maxusedbytes = r->maxused*MEM_UNIT;
+    stats->allocs       = r->allocs;
+    stats->frees        = r->frees;
+#ifdef MEM_SLAB
+    stats->slabobjects  = r->slabobjects;
+    stats->slabbytes    = r->slabbytes;
+#endif
+#ifdef MEM_BITMAP
+    /* Free runs are not counted, the bitmap is */
+    if( ISBITMAP(r) ) {
+        BitmapCount(r,&units,&runs);
+        stats->memleft    = (size_t) units*MEM_UNIT;
+        stats->freebytes  = (size_t) units*MEM_UNIT;
+        stats->freeblocks = runs;
+    }
+#endif
+}
+
+
+/**
+ *  @brief  MemStats
+ *
+ *  @note   Delivers allocation information from counters kept by the region,
+ *          without walking its blocks. The largest and smallest sizes are
+ *          only delivered by MemStatsDeep.
+ *
+ *  @note   Blocks in thread caches and in the remote list are counted as used.
+ *          Blocks reused through a thread cache are not counted in allocs
+ *          and frees.
+ *
+ *  @note   Slab objects are only counted in slabobjects and slabbytes
+ *
+ *  @note   For a bitmap region, the free area and the free blocks are counted
+ *          with popcounts on the bitmap
+ */
+void MemStats( MEMSTATS *stats, uint32_t region ) {
+REGION *r;
+
+    stats->memleft      = 0;
+    stats->freeblocks   = 0;
+    stats->freebytes    = 0;
+    stats->usedblocks   = 0;
+    stats->usedbytes    = 0;
+    stats->largestused  = 0;
+    stats->smallestused = 0;
+    stats->largestfree  = 0;
+    stats->smallestfree = 0;
+    stats->maxusedbytes = 0;
+    stats->allocs       = 0;
+    stats->frees        = 0;
+    stats->slabobjects  = 0;
+    stats->slabbytes    = 0;
+
+    if( region >= MEM_NREGIONS )
+        return;
+    r = &Regions[region];
+
+    LOCK(r);
+    StatsCounters(stats,r);
+    UNLOCK(r);
+}
+
+
+/// Count a free block of size units in stats
+static void StatsFree(MEMSTATS *stats, HWORD size) {
+
+    stats->freeblocks++;
+    stats->freebytes += size;
+    if( size > stats->largestfree )
+        stats->largestfree = size;
+    if( size < stats->smallestfree )
+        stats->smallestfree = size;
+}
+
+/// Count a used block of size units in stats
+static void StatsUsed(MEMSTATS *stats, HWORD size) {
+
+    stats->usedblocks++;
+    stats->usedbytes += size;
+    if( size > stats->largestused )
+        stats->largestused = size;
+    if( size < stats->smallestused )
+        stats->smallestused = size;
+}
+
+/// Count the blocks of region r in stats
+static void StatsBlocks(MEMSTATS *stats, REGION *r) {
+HEADER *p;
+#if defined(MEM_BINS) && !defined(MEM_BESTFIT)
+int32_t i;
+#endif
+
+#ifdef MEM_BESTFIT
+    for(p=r->start;p!=r->end;p=NEXTBLOCK(p)) {
+        if( !p->used ) {
+#elif defined(MEM_BINS)
+    for(i=0;i<MEM_NBINS;i++) {
+        for(p=r->bins[i];p;p=NEXTFREE(p)) {
+#else
+    {
+        for(p=r->free;p;p=NEXTFREE(p)) {
+#endif
+            StatsFree(stats,p->size);
+        }
+    }
+#if defined(MEM_BITMAP) && !defined(MEM_BESTFIT)
+    /* Free runs of a bitmap region are in no list */
+    if( ISBITMAP(r) ) {
+        for(p=r->start;p!=r->end;p=NEXTBLOCK(p)) {
+            if( !p->used )
+                StatsFree(stats,p->size);
+        }
+    }
+#endif
+
+    for(p=r->start;(p < r->end)&&(p->size>0);p=NEXTBLOCK(p)) {
+        if( p->used )
+            StatsUsed(stats,p->size);
+    }
+}
+
+#ifdef MEM_BUDDY
+/// Count the blocks of the buddy region r in stats, from its map
+static void StatsBuddy(MEMSTATS *stats, REGION *r) {
+size_t i, n;
+HWORD size;
+
+    n = BUDDYINDEX(r,r->end);
+    for(i=0;i<n;i+=size/BUDDYMIN) {
+        size = ((HWORD)1)<<(r->buddymap[i]&BUDDYORDER);
+        if( r->buddymap[i]&BUDDYUSED )
+            StatsUsed(stats,size);
+        else
+            StatsFree(stats,size);
+    }
+}
+#endif
+
+
+/**
+ *  @brief  MemStatsDeep
+ *
+ *  @note   Delivers allocation information walking all blocks of the region,
+ *          including the largest and smallest sizes. Blocks in the remote
+ *          list are freed first.
+ */
+void MemStatsDeep( MEMSTATS *stats, uint32_t region ) {
+REGION *r;
+const size_t MAXBYTES = ~(size_t)0;  /* to avoid the inclusion of other headers */
+
+    /* Clears stats */
+    MemStats(stats,region);
+    if( region >= MEM_NREGIONS || !Regions[region].start )
+        return;
+    r = &Regions[region];
+
+    LOCK(r);
+    DRAIN(r);
+    StatsCounters(stats,r);
+    stats->freeblocks  = 0;
+    stats->freebytes   = 0;
+    stats->usedblocks  = 0;
+    stats->usedbytes   = 0;
+    stats->smallestused= MAXBYTES;
+    stats->smallestfree= MAXBYTES;
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) )
+        StatsBuddy(stats,r);
+    else
+#endif
+        StatsBlocks(stats,r);
+    UNLOCK(r);
+    // To avoid "strange" numbers on output
+    if( stats->smallestfree == MAXBYTES )
+        stats->smallestfree = 0;
+    if( stats->smallestused == MAXBYTES )
+        stats->smallestused = 0;
+    // To report sizes in bytes
+    stats->freebytes    *= MEM_UNIT;
+    stats->usedbytes    *= MEM_UNIT;
+    stats->largestfree  *= MEM_UNIT;
+    stats->largestused  *= MEM_UNIT;
+    stats->smallestfree *= MEM_UNIT;
+    stats->smallestused *= MEM_UNIT;
+
+}
+
+/// Count a free block of size units in frag, with the allocations of nelems units it fits
+static void FragFree(MEMFRAG *frag, HWORD size, HWORD nelems) {
+uint32_t i;
+
+    frag->freeblocks++;
+    frag->freebytes += size*MEM_UNIT;
+    if( size*MEM_UNIT > frag->largestfree )
+        frag->largestfree = size*MEM_UNIT;
+    for(i=0;i<MEM_HISTBUCKETS-1 && ((size_t) size*MEM_UNIT>>i);i++)
+        ;
+    frag->freehist[i]++;
+    frag->fits += size/nelems;
+}
+
+/// Count the free blocks of region r in frag
+static void FragBlocks(MEMFRAG *frag, REGION *r, HWORD nelems) {
+HEADER *p;
+#if defined(MEM_BINS) && !defined(MEM_BESTFIT)
+int32_t j;
+#endif
+
+#ifdef MEM_BESTFIT
+    for(p=r->start;p!=r->end;p=NEXTBLOCK(p)) {
+        if( !p->used ) {
+#elif defined(MEM_BINS)
+    for(j=0;j<MEM_NBINS;j++) {
+        for(p=r->bins[j];p;p=NEXTFREE(p)) {
+#else
+    {
+        for(p=r->free;p;p=NEXTFREE(p)) {
+#endif
+            FragFree(frag,p->size,nelems);
+        }
+    }
+#if defined(MEM_BITMAP) && !defined(MEM_BESTFIT)
+    if( ISBITMAP(r) ) {
+        for(p=r->start;p!=r->end;p=NEXTBLOCK(p)) {
+            if( !p->used )
+                FragFree(frag,p->size,nelems);
+        }
+    }
+#endif
+}
+
+#ifdef MEM_BUDDY
+/// Count the free blocks of the buddy region r in frag, from its lists
+static void FragBuddy(MEMFRAG *frag, REGION *r, HWORD nelems) {
+char *q;
+int32_t j;
+
+    for(j=0;j<MEM_SIZEBITS;j++) {
+        for(q=r->orders[j];q;q=BUDDYNEXT(q))
+            FragFree(frag,((HWORD)1)<<j,nelems);
+    }
+}
+#endif
+
+/**
+ *  @brief  MemFragmentation
+ *
+ *  @note   Walks the free blocks of a region and delivers a histogram of their
+ *          sizes and the fragmentation of the region. Ratios are in thousandths:
+ *              external    1 - largest free block / free area
+ *              internal    1 - bytes requested / bytes of the used blocks.
+ *                          The difference is made of headers, rounding to
+ *                          MEM_UNIT and the units kept by blocks when the
+ *                          rest is too small to split.
+ *
+ *  @note   The bytes requested are only recorded with MEM_INSTRUMENT. Without
+ *          it, and for buddy regions, whose blocks have no header to record
+ *          them, internal is MEM_FRAGUNKNOWN.
+ *
+ *  @note   With MEM_THREADCACHE, cached blocks are counted as used. With
+ *          MEM_INSTRUMENT, the bytes requested from them by other threads are
+ *          only counted when these threads return blocks to the region.
+ *
+ *  @note   fits is the number of allocations of nb bytes that the free blocks
+ *          can still satisfy, splitting them as MemAlloc does
+ */
+void MemFragmentation( MEMFRAG *frag, uint32_t region, size_t nb ) {
+REGION *r;
+HWORD nelems;
+uint32_t i;
+
+    frag->freebytes   = 0;
+    frag->freeblocks  = 0;
+    frag->largestfree = 0;
+    frag->fits        = 0;
+    frag->external    = 0;
+    frag->internal    = 0;
+    for(i=0;i<MEM_HISTBUCKETS;i++)
+        frag->freehist[i] = 0;
+
+    if( region >= MEM_NREGIONS || !Regions[region].start )
+        return;
+    r = &Regions[region];
+
+    nelems = (nb+sizeof(HEADER)+MEM_UNIT-1)/MEM_UNIT;
+    if( nelems < MINBLOCK )
+        nelems = MINBLOCK;
+
+    LOCK(r);
+    DRAIN(r);
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) ) {
+        /* Blocks are split in halves and have no header */
+        nelems = BUDDYNELEMS(nb);
+        if( BuddyOrder(nelems) < MEM_SIZEBITS )
+            nelems = ((HWORD)1)<<BuddyOrder(nelems);
+        FragBuddy(frag,r,nelems);
+    } else
+#endif
+        FragBlocks(frag,r,nelems);
+#ifdef MEM_INSTRUMENT
+#ifdef MEM_THREADCACHE
+    CacheSync(r);
+#endif
+    if( ISBUDDY(r) )
+        frag->internal = MEM_FRAGUNKNOWN;
+    else if( r->allocbytes && r->reqbytes <= r->allocbytes )
+        frag->internal = 1000-(uint32_t) (r->reqbytes*1000/r->allocbytes);
+#else
+    frag->internal = MEM_FRAGUNKNOWN;
+#endif
+    UNLOCK(r);
+
+    if( frag->freebytes )
+        frag->external = 1000-(uint32_t) (frag->largestfree*1000/frag->freebytes);
+}
+
+#if defined(DEBUG) || defined(TEST)
+
+#ifdef MEM_BUDDY
+/// List the blocks of the buddy region r, from its map
+static void MemListBuddy(REGION *r) {
+size_t i, n, k;
+HWORD size;
+
+    n = BUDDYINDEX(r,r->end);
+    for(k=0,i=0;i<n;k++,i+=size/BUDDYMIN) {
+        size = ((HWORD)1)<<(r->buddymap[i]&BUDDYORDER);
+        printf("B%02zu (%c): %zu @%p\n",k,(r->buddymap[i]&BUDDYUSED)?'U':'F',
+                    (size_t) (size*MEM_UNIT),(void *) ((char *)r->start+i*BUDDYBYTES));
+    }
+    putchar('\n');
+}
+#endif
+
+/**
+ *  @brief  Memory List
+ *
+ *  @note   List all memory blocks, including size and status
+ *
+ */
+void MemList(uint32_t region) {
+uint32_t i;
+HEADER *p;
+REGION *r;
+
+    r = &Regions[region];
+
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) ) {
+        MemListBuddy(r);
+        return;
+    }
+#endif
+    for(i=0,p=r->start;(p<r->end)&&(p->size>0);i++,p=NEXTBLOCK(p)) {
+        printf("B%02u (%c): %zu @%p (next=%p)\n",i,p->used?'U':'F',
+                    (size_t) (p->size*MEM_UNIT),p,(void *) (p->used?NULL:NEXTFREE(p)));
+    }
+    putchar('\n');
+}
+
+#ifdef MEM_BESTFIT
+/**
+ *  @brief  Check a subtree of free blocks
+ *
+ *  @note   Its blocks must be free, between lo and hi (NULL for no bound) and
+ *          have a priority not higher than their parent. Counts them in n
+ *          and their units in size.
+ */
+static int CheckTree(HEADER *t, HEADER *lo, HEADER *hi, HWORD *n, HWORD *size) {
+HEADER *c;
+
+    if( !t )
+        return 0;
+    if( t->used || (lo && !TreeLess(lo,t)) || (hi && !TreeLess(t,hi)) )
+        return -1;
+    c = TREELEFT(t);
+    if( c && TreePriority(c) > TreePriority(t) )
+        return -1;
+    c = TREERIGHT(t);
+    if( c && TreePriority(c) > TreePriority(t) )
+        return -1;
+    (*n)++;
+    *size += t->size;
+    if( CheckTree(TREELEFT(t),lo,t,n,size) != 0 )
+        return -1;
+    return CheckTree(TREERIGHT(t),t,hi,n,size);
+}
+#endif
+
+#ifdef MEM_BUDDY
+/**
+ *  @brief  Check a buddy region
+ *
+ *  @note   Blocks in the map must cover the region, have 2^k units, be
+ *          aligned to their size and not have a free buddy of the same size
+ */
+static int CheckBuddy(REGION *r) {
+char *p, *buddy;
+HWORD nfree, freesize, nlisted, listsize, nused, usedsize, size;
+size_t i, n;
+int32_t k;
+
+    nfree = freesize = nused = usedsize = 0;
+    n = BUDDYINDEX(r,r->end);
+    for(i=0;i<n;i+=size/BUDDYMIN) {
+        p = (char *) r->start+i*BUDDYBYTES;
+        k = r->buddymap[i]&BUDDYORDER;
+        if( k >= MEM_SIZEBITS )
+            return -13;
+        size = ((HWORD)1)<<k;
+        if( size < BUDDYMIN || (((uintptr_t) p/MEM_UNIT)&(size-1)) != 0 )
+            return -13;
+        if( r->buddymap[i]&BUDDYUSED ) {
+            nused++;
+            usedsize += size;
+        } else {
+            nfree++;
+            freesize += size;
+            buddy = BuddyOf(r,p,k);
+            if( buddy && BUDDYMAP(r,buddy) == k )
+                return -2;                  /* Not combined */
+        }
+    }
+    if( i != n )
+        return -3;
+
+    nlisted = listsize = 0;
+    for(k=0;k<MEM_SIZEBITS;k++) {
+        if( ((r->ordermap>>k)&1) != (r->orders[k] != NULL) )
+            return -4;
+        for(p=r->orders[k];p;p=BUDDYNEXT(p)) {
+            if( BUDDYMAP(r,p) != k )
+                return -5;
+            if( BUDDYNEXT(p) && BUDDYPREV(BUDDYNEXT(p)) != p )
+                return -6;
+            nlisted++;
+            listsize += ((HWORD)1)<<k;
+        }
+    }
+    if( nlisted != nfree || listsize != freesize )
+        return -7;
+    if( r->memleft != freesize )
+        return -8;
+    if( r->freeblocks != nfree || r->usedblocks != nused
+        || r->memsize != freesize+usedsize )
+        return -11;
+    return 0;
+}
+#endif
+
+#ifdef MEM_BITMAP
+/**
+ *  @brief  Check a bitmap region
+ *
+ *  @note   The bits of each block must match its state, free runs must be
+ *          combined and have their header at both ends, and the popcounts of
+ *          the bitmap must match the blocks
+ */
+static int CheckBitmap(REGION *r, uint32_t region) {
+HEADER *p;
+HWORD i, nfree, freesize, nused, usedsize, units, runs;
+
+    nfree = freesize = nused = usedsize = 0;
+    for(p=r->start;(p<r->end)&&(p->size>0);p=NEXTBLOCK(p)) {
+        if( p->region != region )
+            return -1;
+        i = BITUNIT(r,p);
+        if( (p->used ? BITMAPFREE(r,i) : BITMAPUSED(r,i)) < i+p->size )
+            return -15;
+        if( p->used ) {
+            nused++;
+            usedsize += p->size;
+        } else {
+            nfree++;
+            freesize += p->size;
+            if( !NEXTBLOCK(p)->used )
+                return -2;                  /* Not combined */
+            if( NEXTBLOCK(p)[-1].word != p->word )
+                return -10;
+        }
+    }
+    if( p != r->end || !p->used )
+        return -3;
+
+    for(i=r->bitunits;i<r->bitwords*64;i++) {
+        if( !BITUSED(r,i) )
+            return -15;
+    }
+    if( BITMAPFREE(r,0) < r->bitfirst )
+        return -15;
+    BitmapCount(r,&units,&runs);
+    if( units != freesize || runs != nfree )
+        return -7;
+    if( r->memleft != freesize )
+        return -8;
+    if( r->usedblocks != nused || r->memsize != freesize+usedsize )
+        return -11;
+    return 0;
+}
+#endif
+
+#ifdef MEM_SLAB
+/**
+ *  @brief  Check the slabs of a region
+ *
+ *  @note   Free objects must be in the used part of their slab, slabs with
+ *          free objects must be in the list of their size and the counters
+ *          must match the slabs
+ */
+static int CheckSlabs(REGION *r) {
+SLAB *s;
+char *p;
+void *q;
+size_t objects, bytes, listed, partial;
+uint32_t c, n;
+
+    listed = 0;
+    for(c=1;c<=MEM_SLAB_CLASSES;c++) {
+        for(s=r->slabs[c];s;s=s->next) {
+            if( s->size != c*MEM_UNIT || s->used == 0 || SLABFULL(s) )
+                return -1;
+            if( s->next && s->next->prev != s )
+                return -1;
+            listed++;
+        }
+    }
+    objects = bytes = partial = 0;
+    for(p=r->slabstart;p<r->slabtop;p+=MEM_SLAB_BYTES) {
+        s = (SLAB *) p;
+        if( s->used == 0 )
+            continue;
+        for(n=0,q=s->free;q;q=*(void **)q,n++) {
+            if( SLABOF(q) != s || (char *) q < p+SLABHEAD || (char *) q >= s->unused )
+                return -1;
+        }
+        if( n+s->used != (s->unused-(p+SLABHEAD))/s->size )
+            return -1;
+        if( !SLABFULL(s) )
+            partial++;
+        objects += s->used;
+        bytes   += (size_t) s->used*s->size;
+    }
+    if( listed != partial || objects != r->slabobjects || bytes != r->slabbytes )
+        return -1;
+    return 0;
+}
+#endif
+
+/**
+ *  @brief  Check a region
+ *
+ *  @note   Lock of the region must be held
+ */
+static int CheckRegion(REGION *r, uint32_t region) {
+HEADER *p;
+HWORD nfree, freesize, nlisted, listsize, nused, usedsize;
+#if defined(MEM_BINS) && !defined(MEM_BESTFIT)
+int32_t i;
+#endif
+
+#ifdef MEM_SLAB
+    if( r->slabstart && CheckSlabs(r) != 0 )
+        return -14;
+#endif
+    if( !r->start )
+        return 0;
+#ifdef MEM_BUDDY
+    if( ISBUDDY(r) )
+        return CheckBuddy(r);
+#endif
+#ifdef MEM_BITMAP
+    if( ISBITMAP(r) )
+        return CheckBitmap(r,region);
+#endif
+
+    /* Blocks must cover the region up to the sentinel */
+    nfree = freesize = nused = usedsize = 0;
+    for(p=r->start;(p<r->end)&&(p->size>0);p=NEXTBLOCK(p)) {
+        if( p->region != region && p->used )
+            return -1;
+        if( p->used ) {
+            nused++;
+            usedsize += p->size;
+        } else {
+            nfree++;
+            freesize += p->size;
+#if !defined(MEM_SEGREGATED) || defined(MEM_BOUNDARYTAGS)
+            if( !NEXTBLOCK(p)->used )
+                return -2;                  /* Not combined */
+#endif
+        }
+#ifdef MEM_BOUNDARYTAGS
+        if( NEXTBLOCK(p)->prevfree != !p->used )
+            return -9;
+        if( !p->used && FOOTER(p) != p->size )
+            return -10;
+#endif
+    }
+    if( p != r->end || !p->used )
+        return -3;
+
+    /* All free blocks must be in the list(s) */
+    nlisted = listsize = 0;
+#ifdef MEM_BESTFIT
+    if( CheckTree(r->root,NULL,NULL,&nlisted,&listsize) != 0 )
+        return -5;
+#elif defined(MEM_BINS)
+    for(i=0;i<MEM_NBINS;i++) {
+        if( BinIsSet(r,i) != (r->bins[i] != NULL) )
+            return -4;
+        for(p=r->bins[i];p;p=NEXTFREE(p)) {
+            if( p->used || BinIndex(p->size) != i )
+                return -5;
+            if( NEXTFREE(p) && FREEPREV(NEXTFREE(p)) != p )
+                return -6;
+            nlisted++;
+            listsize += p->size;
+        }
+    }
+#else
+    for(p=r->free;p;p=NEXTFREE(p)) {
+        if( p->used || (NEXTFREE(p) && NEXTFREE(p) <= p) )
+            return -5;
+#ifdef MEM_BOUNDARYTAGS
+        if( NEXTFREE(p) && FREEPREV(NEXTFREE(p)) != p )
+            return -6;
+#endif
+        nlisted++;
+        listsize += p->size;
+    }
+#ifdef MEM_NEXTFIT
+    /* The rover must be a listed block */
+    for(p=r->free;p && p!=r->rover;p=NEXTFREE(p))
+        ;
+    if( p != r->rover )
+        return -12;
+#endif
+#endif
+    if( nlisted != nfree || listsize != freesize )
+        return -7;
+    if( r->memleft != freesize )
+        return -8;
+    if( r->freeblocks != nfree || r->usedblocks != nused
+        || r->memsize != freesize+usedsize )
+        return -11;
+    return 0;
+}
+
+/**
+ *  @brief  Memory Check
+ *
+ *  @note   Verifies the consistency of the blocks and of the free list(s) of a region
+ *
+ *  @note   Returns 0 when everything is OK, otherwise a negative number
+ */
+int MemCheck(uint32_t region) {
+REGION *r;
+int rc;
+
+    r = &Regions[region];
+    LOCK(r);
+    DRAIN(r);
+    rc = CheckRegion(r,region);
+    UNLOCK(r);
+    return rc;
+}
+
+#endif
+
+//////////////////////// TEST  ///////////////////////////////////////////////////////////////////
+
+#ifdef TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+void PrintStats(char *msg, MEMSTATS *stats ) {
+
+    puts(msg);
+    printf("Free blocks      = %zu\n",stats->freeblocks);
+    printf("Free bytes       = %zu\n",stats->freebytes);
+    printf("Smallest free    = %zu\n",stats->smallestfree);
+    printf("Largest free     = %zu\n",stats->largestfree);
+    printf("Used blocks      = %zu\n",stats->usedblocks);
+    printf("Used bytes       = %zu\n",stats->usedbytes);
+    printf("Smallest used    = %zu\n",stats->smallestused);
+    printf("Largest used     = %zu\n",stats->largestused);
+    printf("Memory left      = %zu\n",stats->memleft);
+    printf("Highest used     = %zu\n",stats->maxusedbytes);
+    printf("Allocations      = %llu\n",(unsigned long long) stats->allocs);
+    printf("Frees            = %llu\n",(unsigned long long) stats->frees);
+
+}
+
+#define BUFFERSIZE 160
+
+static uint32_t buffer[(BUFFERSIZE+sizeof(uint32_t)-1)/sizeof(uint32_t)];
+
+/**
+ *  @brief  Random allocation test
+ *
+ *  @note   Allocates and frees blocks of random sizes, fills them with a pattern
+ *          and verifies the pattern and the consistency of the region.
+ *          Returns the number of errors found.
+ */
+#ifdef DEBUG
+#define TESTITERATIONS  200
+#else
+#define TESTITERATIONS  200000
+#endif
+#define TESTSLOTS       64
+#define TESTAREASIZE    16384
+
+static uint32_t testarea[TESTAREASIZE/sizeof(uint32_t)];
+
+int TestRandom(void) {
+unsigned char *slot[TESTSLOTS];
+unsigned char *p;
+uint32_t size[TESTSLOTS];
+uint32_t i, j, k, m;
+int errors = 0;
+MEMSTATS stats, counted, walked;
+
+    MemAddRegion(1,testarea,TESTAREASIZE);
+    MemStats(&stats,1);
+    for(i=0;i<TESTSLOTS;i++)
+        slot[i] = NULL;
+
+    srand(1);
+    for(i=0;i<TESTITERATIONS;i++) {
+        k = rand()%TESTSLOTS;
+        if( slot[k] ) {
+            for(j=0;j<size[k];j++) {
+                if( slot[k][j] != (unsigned char) k ) {
+                    errors++;
+                    break;
+                }
+            }
+            if( rand()%4 == 0 ) {
+                /* Resize, keeping the contents */
+                j = rand()%(rand()%8?64:1024);
+                p = MemRealloc(slot[k],j);
+                if( p || j == 0 ) {
+                    if( p && MemSize(p) < j )
+                        errors++;
+                    for(m=0;p && m<j && m<size[k];m++) {
+                        if( p[m] != (unsigned char) k ) {
+                            errors++;
+                            break;
+                        }
+                    }
+                    if( p )
+                        memset(p,k,j);
+                    slot[k] = p;
+                    size[k] = j;
+                }
+            } else {
+                MemFree(slot[k]);
+                slot[k] = NULL;
+            }
+        } else {
+            size[k] = rand()%(rand()%8?64:1024);
+            slot[k] = MemAlloc(size[k],1);
+            if( slot[k] && MemSize(slot[k]) < size[k] )
+                errors++;
+            if( slot[k] )
+                memset(slot[k],k,size[k]);
+        }
+        if( (i%97) == 0 && MemCheck(1) != 0 ) {
+            printf("MemCheck failed with %d at iteration %u\n",MemCheck(1),i);
+            errors++;
+            break;
+        }
+    }
+    /* Counters must agree with the walk */
+    MemStats(&counted,1);
+    MemStatsDeep(&walked,1);
+    if( counted.freebytes != walked.freebytes || counted.usedbytes != walked.usedbytes
+        || counted.freeblocks != walked.freeblocks || counted.usedblocks != walked.usedblocks
+        || counted.maxusedbytes < counted.usedbytes || counted.allocs < counted.frees )
+        errors++;
+    for(k=0;k<TESTSLOTS;k++)
+        MemFree(slot[k]);
+    MemFlushCache();
+    if( MemCheck(1) != 0 )
+        errors++;
+    /* Everything must be combined again */
+    slot[0] = MemAlloc(stats.memleft-sizeof(HEADER),1);
+    if( slot[0] == NULL )
+        errors++;
+    MemFree(slot[0]);
+
+    printf("Random test: %d error(s)\n",errors);
+    return errors;
+}
+
+/**
+ *  @brief  Add a region again as a region of the free list organization
+ *
+ *  @note   The tests before may have left it with another type, or with slabs.
+ *          Its old blocks must not be used anymore.
+ */
+static void TestNewRegion(uint32_t region, void *area, size_t size) {
+REGION *r;
+uint32_t i;
+
+    MemFlushCache();
+    r = &Regions[region];
+#ifdef MEM_BUDDY
+    for(i=0;i<NBuddyRegions && BuddyRegions[i]!=r;i++)
+        ;
+    if( i < NBuddyRegions )
+        BuddyRegions[i] = BuddyRegions[--NBuddyRegions];
+#endif
+#ifdef MEM_SLAB
+    for(i=0;i<NSlabRegions && SlabRegions[i]!=r;i++)
+        ;
+    if( i < NSlabRegions )
+        SlabRegions[i] = SlabRegions[--NSlabRegions];
+#endif
+    (void) i;
+    memset(r,0,sizeof(REGION));
+    MemAddRegion(region,area,size);
+}
+
+/**
+ *  @brief  Timing test
+ *
+ *  @note   Fragments a region with thousands of small free blocks and then
+ *          measures the worst case and mean number of cycles (nanoseconds when
+ *          there is no cycle counter) of MemAlloc and MemFree.
+ */
+#define TIMINGAREASIZE  (1024*1024)
+#define TIMINGBLOCKS    4096
+
+static uint32_t timingarea[TIMINGAREASIZE/sizeof(uint32_t)];
+static void *timingblock[TIMINGBLOCKS];
+
+static uint64_t Cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+#endif
+}
+
+void TestTiming(void) {
+uint32_t i, k, n;
+uint64_t t, dt, allocmax, allocsum, freemax, freesum;
+void *tmp;
+
+    TestNewRegion(2,timingarea,TIMINGAREASIZE);
+    srand(2);
+
+    /* Fill the region and free every other block */
+    for(n=0;n<TIMINGBLOCKS;n++) {
+        timingblock[n] = MemAlloc(16+rand()%112,2);
+        if( !timingblock[n] )
+            break;
+    }
+    for(i=0;i<n;i+=2) {
+        MemFree(timingblock[i]);
+        timingblock[i] = NULL;
+    }
+
+    /* Requests larger than every fragment */
+    allocmax = allocsum = 0;
+    for(i=0;i<n;i+=4) {
+        t = Cycles();
+        timingblock[i] = MemAlloc(160+rand()%96,2);
+        dt = Cycles()-t;
+        allocsum += dt;
+        if( dt > allocmax )
+            allocmax = dt;
+    }
+
+    /* Free everything in random order */
+    for(i=n-1;i>0;i--) {
+        k = rand()%(i+1);
+        tmp = timingblock[i];
+        timingblock[i] = timingblock[k];
+        timingblock[k] = tmp;
+    }
+    freemax = freesum = 0;
+    for(i=0;i<n;i++) {
+        t = Cycles();
+        MemFree(timingblock[i]);
+        dt = Cycles()-t;
+        freesum += dt;
+        if( dt > freemax )
+            freemax = dt;
+    }
+
+    printf("MemAlloc cycles: worst %llu mean %llu\n",
+                (unsigned long long) allocmax,(unsigned long long) (allocsum/(n/4)));
+    printf("MemFree  cycles: worst %llu mean %llu\n",
+                (unsigned long long) freemax,(unsigned long long) (freesum/n));
+}
+
+
+#ifdef MEM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+/**
+ *  @brief  Multithread stress test
+ *
+ *  @note   Each thread allocates and frees random blocks in a region shared
+ *          with one other thread (regions 1 and 2, left empty by the other
+ *          tests) and in a region shared by all threads. Blocks in the shared region are
+ *          also passed between threads, so they are freed by another thread.
+ *          Each block holds its size and a pattern that is verified on free.
+ *
+ *  @note   The shared region is added again, as TestBitmap leaves it a bitmap
+ *          region
+ */
+#define STRESSTHREADS   4
+#define STRESSITERATIONS 200000
+#define STRESSSLOTS     64
+#define STRESSAREASIZE  (256*1024)
+#define STRESSSHARED    3
+
+static uint32_t stressarea[STRESSAREASIZE/sizeof(uint32_t)];
+static _Atomic(uint32_t *) stressexchange[STRESSSLOTS];
+static atomic_int stresserrors;
+
+static uint32_t *StressAlloc(uint32_t size, uint32_t region) {
+uint32_t *p;
+
+    p = MemAlloc(size,region);
+    if( p ) {
+        p[0] = size;
+        memset(p+1,(unsigned char) size,size-sizeof(uint32_t));
+    }
+    return p;
+}
+
+static void StressFree(uint32_t *p) {
+unsigned char *c;
+uint32_t i;
+
+    if( !p )
+        return;
+    c = (unsigned char *) (p+1);
+    for(i=0;i<p[0]-sizeof(uint32_t);i++) {
+        if( c[i] != (unsigned char) p[0] ) {
+            atomic_fetch_add(&stresserrors,1);
+            break;
+        }
+    }
+    MemFree(p);
+}
+
+static void *StressThread(void *arg) {
+uint32_t *slot[STRESSSLOTS];
+uint32_t i, k, region, own;
+unsigned seed;
+
+    own  = 1+((uintptr_t) arg&1);
+    seed = 1+(uintptr_t) arg;
+    for(k=0;k<STRESSSLOTS;k++)
+        slot[k] = NULL;
+
+    for(i=0;i<STRESSITERATIONS;i++) {
+        k = rand_r(&seed)%STRESSSLOTS;
+        region = (i&1) ? STRESSSHARED : own;
+        if( slot[k] ) {
+            StressFree(slot[k]);
+            slot[k] = NULL;
+        } else if( region == STRESSSHARED && (rand_r(&seed)&3) == 0 ) {
+            /* Pass a block to another thread */
+            StressFree(atomic_exchange(&stressexchange[k],StressAlloc(4+rand_r(&seed)%200,region)));
+        } else {
+            slot[k] = StressAlloc(4+rand_r(&seed)%200,region);
+        }
+    }
+    for(k=0;k<STRESSSLOTS;k++)
+        StressFree(slot[k]);
+    return NULL;
+}
+
+/**
+ *  @brief  Producer and consumer test
+ *
+ *  @note   The producer allocates blocks from region 1 and passes them through
+ *          a ring to the consumer, that frees them. With MEM_REMOTEFREE, all
+ *          frees go through the remote list of the region.
+ */
+#define PIPELINESIZE    256
+#define PIPELINEBLOCKS  200000
+
+static _Atomic(uint32_t *) pipeline[PIPELINESIZE];
+
+static void *Producer(void *arg) {
+uint32_t i;
+uint32_t *p;
+unsigned seed = 3;
+
+    (void) arg;
+    for(i=0;i<PIPELINEBLOCKS;i++) {
+        while( (p = StressAlloc(4+rand_r(&seed)%200,1)) == NULL )
+            sched_yield();
+        while( atomic_load(&pipeline[i%PIPELINESIZE]) )
+            sched_yield();
+        atomic_store(&pipeline[i%PIPELINESIZE],p);
+    }
+    return NULL;
+}
+
+static void *Consumer(void *arg) {
+uint32_t i;
+uint32_t *p;
+
+    (void) arg;
+    for(i=0;i<PIPELINEBLOCKS;i++) {
+        while( (p = atomic_exchange(&pipeline[i%PIPELINESIZE],NULL)) == NULL ) {
+            /* Without MEM_REMOTEFREE, the producer may wait for cached blocks */
+            MemFlushCache();
+            sched_yield();
+        }
+        StressFree(p);
+    }
+    return NULL;
+}
+
+int TestThreads(void) {
+pthread_t th[STRESSTHREADS];
+uint32_t i;
+int errors;
+
+    TestNewRegion(STRESSSHARED,stressarea,STRESSAREASIZE);
+    for(i=0;i<STRESSTHREADS;i++)
+        pthread_create(&th[i],NULL,StressThread,(void *) (uintptr_t) i);
+    for(i=0;i<STRESSTHREADS;i++)
+        pthread_join(th[i],NULL);
+    for(i=0;i<STRESSSLOTS;i++)
+        StressFree(atomic_exchange(&stressexchange[i],NULL));
+    MemFlushCache();
+
+    pthread_create(&th[0],NULL,Producer,NULL);
+    pthread_create(&th[1],NULL,Consumer,NULL);
+    pthread_join(th[0],NULL);
+    pthread_join(th[1],NULL);
+
+    errors = atomic_load(&stresserrors);
+    for(i=0;i<=STRESSSHARED;i++) {
+        if( MemCheck(i) != 0 )
+            errors++;
+    }
+    printf("Thread test: %d error(s)\n",errors);
+    return errors;
+}
+#endif
+
+#if defined(MEM_HEADER64) && defined(__linux__) && UINTPTR_MAX > 0xFFFFFFFFu
+#include <sys/mman.h>
+
+#define LARGEREGION     (MEM_NREGIONS-1)
+#define LARGEAREA       (((size_t)6)<<30)
+#define LARGEBLOCK      (((size_t)5)<<30)
+
+/**
+ *  @brief  Allocation of a block larger than 4 GBytes
+ *
+ *  @note   The area is reserved without backing store, so only the touched
+ *          pages are really used
+ */
+int TestLarge(void) {
+void *area;
+char *p;
+MEMSTATS stats;
+int errors = 0;
+
+    area = mmap(NULL,LARGEAREA,PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if( area == MAP_FAILED ) {
+        printf("Large test: no address space\n");
+        return 0;
+    }
+    MemAddRegion(LARGEREGION,area,LARGEAREA);
+    p = MemAlloc(LARGEBLOCK,LARGEREGION);
+    if( !p )
+        errors++;
+    else {
+        p[0] = 1;
+        p[LARGEBLOCK-1] = 1;
+        MemStatsDeep(&stats,LARGEREGION);
+        if( stats.largestused < LARGEBLOCK )
+            errors++;
+        MemFree(p);
+    }
+    if( MemCheck(LARGEREGION) != 0 )
+        errors++;
+    MemStats(&stats,LARGEREGION);
+    PrintStats("Large region",&stats);
+    if( stats.usedblocks != 0 || stats.freebytes < LARGEBLOCK )
+        errors++;
+    munmap(area,LARGEAREA);
+    printf("Large test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestLarge(void) {
+    return 0;
+}
+#endif
+
+#ifdef MEM_GROWABLE
+#define GROWREGION      1
+#define GROWRESERVE     (4*1024*1024)
+#define GROWINITIAL     4096
+#define GROWBLOCKS      256
+#define GROWBLOCKSIZE   1000
+
+/**
+ *  @brief  Growable region test
+ *
+ *  @note   Region 1 starts with one step of memory and must grow to hold all
+ *          blocks. It stays growable for the tests that follow.
+ */
+int TestGrowable(void) {
+void *block[GROWBLOCKS];
+void *p;
+MEMSTATS stats;
+uint32_t i;
+int errors = 0;
+
+    if( MemAddGrowableRegion(GROWREGION,GROWRESERVE,GROWINITIAL) != 0 ) {
+        printf("Growable test: region not added\n");
+        return 1;
+    }
+    for(i=0;i<GROWBLOCKS;i++) {
+        block[i] = MemAlloc(GROWBLOCKSIZE,GROWREGION);
+        if( block[i] )
+            memset(block[i],i,GROWBLOCKSIZE);
+        else
+            errors++;
+    }
+    /* Larger than a growth step */
+    p = MemAlloc(GROWRESERVE/4,GROWREGION);
+    if( !p )
+        errors++;
+    MemFree(p);
+    /* Beyond the reserved range */
+    if( MemAlloc(GROWRESERVE,GROWREGION) != NULL )
+        errors++;
+    if( MemCheck(GROWREGION) != 0 )
+        errors++;
+    MemStats(&stats,GROWREGION);
+    if( stats.usedbytes < GROWBLOCKS*GROWBLOCKSIZE )
+        errors++;
+    for(i=0;i<GROWBLOCKS;i++)
+        MemFree(block[i]);
+    MemFlushCache();
+    if( MemCheck(GROWREGION) != 0 )
+        errors++;
+    MemStats(&stats,GROWREGION);
+    if( stats.usedblocks != 0 )
+        errors++;
+    printf("Growable test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestGrowable(void) {
+    return 0;
 }
+#endif
 
+#ifdef MEM_TRIM
+#define TRIMREGION      1
+#define TRIMBLOCKSIZE   8192
 
 /**
- *  @brief  MemInit
- *
- *  @note   Initializes heap info
+ *  @brief  Trim test
  *
- *  @note   There are two versions. A version without parameters, that uses
- *          symbols defined by the linker. Another one, with explicit parameters.
- *          The preprocessor symbol MEM_LINKERINIT chooses one
+ *  @note   A large block is freed behind a small one. Its pages must be
+ *          released without touching the small block.
  */
-#ifdef MEM_LINKERINIT
-void MemInit(void) {
-
-uint32_t size = (char *) &_heapend - char *) &_heapstart;
-
-    MemAddRegion( 0, &_heapstart, size);
+int TestTrim(void) {
+unsigned char *p, *q;
+size_t released;
+uint32_t i;
+int errors = 0;
 
+    /* So MEM_TRIM_THRESHOLD does not trim before MemTrim */
+    MemTrim(TRIMREGION);
+    q = MemAlloc(64,TRIMREGION);
+    p = MemAlloc(TRIMBLOCKSIZE,TRIMREGION);
+    if( !p || !q ) {
+        printf("Trim test: no memory\n");
+        return 1;
+    }
+    memset(q,0x5A,64);
+    memset(p,0xA5,TRIMBLOCKSIZE);
+    MemFree(p);
+    released = MemTrim(TRIMREGION);
+    if( released == 0 )
+        errors++;
+    /* Nothing left to release */
+    if( MemTrim(TRIMREGION) != 0 )
+        errors++;
+    for(i=0;i<64;i++) {
+        if( q[i] != 0x5A ) {
+            errors++;
+            break;
+        }
+    }
+    if( MemCheck(TRIMREGION) != 0 )
+        errors++;
+    /* Released pages can be used again */
+    p = MemAlloc(TRIMBLOCKSIZE,TRIMREGION);
+    if( !p )
+        errors++;
+    else
+        memset(p,0xA5,TRIMBLOCKSIZE);
+    MemFree(p);
+    MemFree(q);
+    if( MemCheck(TRIMREGION) != 0 )
+        errors++;
+    printf("Trim test: %zu bytes released, %d error(s)\n",released,errors);
+    return errors;
 }
 #else
-void MemInit(void *area, uint32_t size) {
-
-    MemAddRegion( 0, area, size);
-
+int TestTrim(void) {
+    return 0;
 }
 #endif
 
+#ifdef MEM_INSTRUMENT
+#define HISTREGION      1
+
+void PrintHistogram(char *msg, uint64_t *h) {
+uint32_t i;
+
+    puts(msg);
+    for(i=0;i<MEM_HISTBUCKETS;i++) {
+        if( h[i] )
+            printf("  < %-12llu %llu\n",1ULL<<i,(unsigned long long) h[i]);
+    }
+}
 
 /**
- *  @brief  MemFree
- *
- *  @note   Return memory to free list.
- *          Where possible, make contiguous blocks of free memory.
- *          Assumes that 0 is not a valid address for allocation. Also,
- *          MemInit() must be called prior to using either MemFree() or MemAlloc();
+ *  @brief  Instrumentation test
  *
- *  @note   The Free List is kept in crescent order of address
- *
- *  @note   There are 4 case to consider:
- *
- *  Previous |  Next  | Action
- *  ---------|--------|--------------------------
- *   Busy    |  Busy  | Just add this block to free list
- *   Free    |  Busy  | Add size to the previous block
- *   Busy    |  Free  | Add size of the next block, add this block to list
- *   Free    |  Free  | Add size of the next block and combine both to previous one
- *
- *  Attention: Do not forget the remove the combined blocks from free list
- *
- *  There are the limit cases to consider, start and end of area
+ *  @note   One allocation of 100 bytes must be counted in bucket 7. The other
+ *          entry points must be counted once for each block, even when they
+ *          call MemAlloc or MemFree.
  */
-void MemFree(void *p) {
-HEADER *block, *prev, *f, *old, *nxt;
-REGION *r;
+int TestInstrument(void) {
+MEMHIST before, after;
+uint64_t nbefore = 0, nafter = 0;
+uint32_t i;
+void *p, *batch[4];
+size_t n;
+int errors = 0;
 
-    if( !p )
-        return;
+    MemHistogram(&before,HISTREGION);
+    p = MemAlloc(100,HISTREGION);
+    MemFree(p);
+    MemHistogram(&after,HISTREGION);
+    if( after.size[7] != before.size[7]+1 )
+        errors++;
+    for(i=0;i<MEM_HISTBUCKETS;i++) {
+        nbefore += before.alloc[i]+before.free[i];
+        nafter  += after.alloc[i]+after.free[i];
+    }
+    if( nafter != nbefore+2 )
+        errors++;
 
-    f = (HEADER *)p - 1;                /* Point to header of block being returned. */
-#ifdef DEBUG
-    printf("Freeing element at %p with %d elements and area at %p\n",f,f->size,p);
+    /* 1 aligned, 1 realloc and n batch allocations, n batch frees and 1 realloc free */
+    before = after;
+    p = MemAllocAligned(100,64,HISTREGION);
+    p = MemRealloc(p,200);
+    n = MemAllocBatch(100,4,HISTREGION,batch);
+    MemFreeBatch(batch,n);
+    MemRealloc(p,0);
+    MemHistogram(&after,HISTREGION);
+    if( after.size[7] != before.size[7]+1+n || after.size[8] != before.size[8]+1 )
+        errors++;
+    nbefore = nafter = 0;
+    for(i=0;i<MEM_HISTBUCKETS;i++) {
+        nbefore += before.alloc[i]+before.free[i];
+        nafter  += after.alloc[i]+after.free[i];
+    }
+    if( n == 0 || nafter != nbefore+3+2*n )
+        errors++;
+    PrintHistogram("Sizes requested",after.size);
+    PrintHistogram("MemAlloc cycles",after.alloc);
+    PrintHistogram("MemFree cycles",after.free);
+    printf("Instrument test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestInstrument(void) {
+    return 0;
+}
 #endif
 
-    // Already free
-    if( !f->used )
-        return;
+#define FRAGREGION      1
+#define FRAGBLOCKS      16
+#define FRAGBLOCKSIZE   512
 
-    // Get region used for allocation
-    r = &Regions[f->region];
+/**
+ *  @brief  Fragmentation test
+ *
+ *  @note   Freeing every other block leaves holes that only fit blocks of the
+ *          same size
+ */
+int TestFragmentation(void) {
+void *block[FRAGBLOCKS];
+MEMFRAG frag;
+size_t n;
+uint32_t i;
+int errors = 0;
 
-    r->memleft += f->size;
+    for(i=0;i<FRAGBLOCKS;i++)
+        block[i] = MemAlloc(FRAGBLOCKSIZE,FRAGREGION);
+    for(i=0;i<FRAGBLOCKS;i+=2)
+        MemFree(block[i]);
+    MemFragmentation(&frag,FRAGREGION,FRAGBLOCKSIZE);
+    if( frag.freeblocks < FRAGBLOCKS/2 || frag.fits < FRAGBLOCKS/2 )
+        errors++;
+    if( frag.external == 0 )
+        errors++;
+#ifdef MEM_INSTRUMENT
+    if( frag.internal == 0 || frag.internal >= 1000 )
+        errors++;
+#else
+    if( frag.internal != MEM_FRAGUNKNOWN )
+        errors++;
+#endif
+    for(i=0,n=0;i<MEM_HISTBUCKETS;i++)
+        n += frag.freehist[i];
+    if( n != frag.freeblocks )
+        errors++;
+    printf("Fragmentation: %zu free blocks, external %u/1000, internal %u/1000\n",
+            frag.freeblocks,frag.external,frag.internal);
+    /* The holes do not fit a larger block */
+    n = frag.fits;
+    MemFragmentation(&frag,FRAGREGION,2*FRAGBLOCKSIZE);
+    if( frag.fits+FRAGBLOCKS/2 > n )
+        errors++;
+    for(i=1;i<FRAGBLOCKS;i+=2)
+        MemFree(block[i]);
+    MemFlushCache();
+    printf("Fragmentation test: %d error(s)\n",errors);
+    return errors;
+}
 
-    /*
-     * The Free list in kept in crescent order of address.
-     *
-     * Free-space head is higher up in memory than returnee. The returnee will
-     * be the new head
-     */
-    if (f < r->free ) {
-        old = r->free;                    /* Old head */
-        r->free = f;                        /* New head */
-        /* The only possibility is that the old head points to a contiguos block*/
-        nxt = f + f->size;                 /* Right after new head */
+#define REALLOCREGION   1
+#define REALLOCSIZE     1024
 
-        if (nxt == old) {                /* Old and new are contiguous. */
-            f->size += old->size;         /* Combine them    */
-            f->next = old->next;          /* forming one block. */
-        } else {
-            f->next = old;
+/**
+ *  @brief  Realloc test
+ *
+ *  @note   A block is shrunk and grown again in place, then grown to a size
+ *          that may move it
+ */
+int TestRealloc(void) {
+unsigned char *p, *q;
+MEMSTATS before, after;
+uint32_t i;
+int errors = 0;
+
+    p = MemAlloc(REALLOCSIZE,REALLOCREGION);
+    if( !p ) {
+        printf("Realloc test: no memory\n");
+        return 1;
+    }
+    for(i=0;i<REALLOCSIZE;i++)
+        p[i] = (unsigned char) i;
+    MemStats(&before,REALLOCREGION);
+    q = MemRealloc(p,REALLOCSIZE/8);
+    MemStats(&after,REALLOCREGION);
+    if( q != p || MemSize(q) >= REALLOCSIZE || after.freebytes <= before.freebytes )
+        errors++;
+    /* The tail was freed just after the block */
+    q = MemRealloc(p,REALLOCSIZE);
+    if( q != p || MemSize(q) < REALLOCSIZE )
+        errors++;
+    if( MemCheck(REALLOCREGION) != 0 )
+        errors++;
+    /* In place or not, the contents are kept */
+    p = MemRealloc(p,8*REALLOCSIZE);
+    if( !p )
+        errors++;
+    for(i=0;p && i<REALLOCSIZE/8;i++) {
+        if( p[i] != (unsigned char) i ) {
+            errors++;
+            break;
         }
-        f->used = 0;
-        return;
     }
+    if( MemRealloc(p,0) != NULL )
+        errors++;
+    MemFlushCache();
+    if( MemCheck(REALLOCREGION) != 0 )
+        errors++;
+    printf("Realloc test: %d error(s)\n",errors);
+    return errors;
+}
 
-    /*
-     * Otherwise, current free-space head is lower in memory. Walk down
-     * free-space list looking for the block being returned. If the next pointer
-     * points past the block, make a new entry and link it. If next pointer plus
-     * its size points to the block, form one contiguous block.
-     */
+#define ALIGNREGION     1
+#define ALIGNBLOCKS     8
+#define ALIGNMAX        1024
 
-    block = r->free;
-    prev = NULL;
-    while ( block && f > block  ) {
-        if (block+block->size == f) {
-            block->size += f->size;     /* They're contiguous. */
-            f = block + block->size;     /* Form one block. */
-            if (f==block->next) {
-                /*
-                 * The new, larger block is contiguous to the next free block,
-                 * so form a larger block. There's no need to continue this checking
-                 * since if the block following this free one
-                 * were free, the two would already have been combined.
-                 */
-                block->size += f->size;
-                block->next = f->next;
-                block->used = 0;
+/**
+ *  @brief  Aligned allocation test
+ *
+ *  @note   Blocks of each alignment up to ALIGNMAX must be aligned, must not
+ *          be much larger than requested and must leave the region as it was
+ *          when freed. Each search needs a free block larger than the
+ *          alignment, so ALIGNMAX is small for the area of TestRandom.
+ */
+int TestAligned(void) {
+unsigned char *block[ALIGNBLOCKS];
+MEMSTATS before, after;
+size_t align, nb;
+uint32_t i;
+int errors = 0;
+
+    if( MemAllocAligned(16,24,ALIGNREGION) != NULL )
+        errors++;
+    MemStats(&before,ALIGNREGION);
+    for(align=MEM_UNIT;align<=ALIGNMAX;align*=2) {
+        for(i=0;i<ALIGNBLOCKS;i++) {
+            nb = 1+(i*37)%200;
+            block[i] = MemAllocAligned(nb,align,ALIGNREGION);
+            if( !block[i] || ((uintptr_t) block[i]&(align-1)) != 0
+                || MemSize(block[i]) < nb || MemSize(block[i]) >= nb+2*MINBLOCK*MEM_UNIT ) {
+                errors++;
+                continue;
             }
-            return;
+            memset(block[i],i,nb);
         }
-        prev=block;
-        block=block->next;
-    }
-
-    /*
-     * The address of the block being returned is greater than one in
-     * the free queue (block) or the end of the queue was reached.
-     * If at end, just link to the end of the queue.
-     * Therefore, block is null or points to a block higher up in memory
-     * than the one being returned.
-     */
-    prev->next = f;                 /* link to queue */
-    prev = f + f->size;             /* right after space to free */
-    if (prev == block) {            /* 'f' and 'block' are contiguous. */
-        f->size += block->size;
-        f->next = block->next;         /* Form a larger, contiguous block. */
-    } else {
-        f->next = block;
+        if( MemCheck(ALIGNREGION) != 0 )
+            errors++;
+        for(i=0;i<ALIGNBLOCKS;i++)
+            MemFree(block[i]);
+        MemFlushCache();
     }
-    f->used = 0;
-    return;
+    if( MemCheck(ALIGNREGION) != 0 )
+        errors++;
+    MemStats(&after,ALIGNREGION);
+    if( after.usedblocks != before.usedblocks || after.freebytes != before.freebytes )
+        errors++;
+    printf("Aligned test: %d error(s)\n",errors);
+    return errors;
 }
 
+#define BATCHREGION     1
+#define BATCHBLOCKS     100
+#define BATCHSIZE       24
+#define BATCHHOLES      8
 
 /**
- *  @brief  MemAlloc
- *
- *  @note   Returns a pointer to an allocate memory block if found.
- *          Otherwise, returns NULL
+ *  @brief  Batch test
  *
- *  @note   It uses a first fit algorithm
- *
- *  @note   Allocate the space requested plus space for the header of the block.
- *          Search the free-space queue for a block that's large enough.
- *          If block is larger than needed, break into two pieces
- *          and allocate the portion higher up in memory.
- *          Otherwise, just allocate the entire block.
+ *  @note   A batch of blocks is allocated, then freed in random order with
+ *          some NULL pointers. The region must be as before.
  *
+ *  @note   Then a batch is carved from holes of a few blocks each and from
+ *          the rest of the region.
  */
-void *MemAlloc(uint32_t nb, uint32_t region) {
-HEADER *block, *prev;
-REGION *r;
-uint32_t    nelems;
-
-    /* Round to a multiple of sizeof(HEADER) */
-    nelems = (nb+sizeof(HEADER)-1)/sizeof(HEADER) + 1;
-
-#ifdef DEBUG
-    printf("Allocating %u bytes (=%u elements)\n",nb,nelems);
-#endif
+int TestBatch(void) {
+unsigned char *block[BATCHBLOCKS+2];
+void *hole[BATCHHOLES], *sep[BATCHHOLES];
+MEMSTATS before, after;
+size_t n;
+uint32_t i, j, k;
+int errors = 0;
 
-    r = &Regions[region];
-
-    for (prev=NULL,block=r->free; block!=NULL; block = block->next) {
-        /* First fit */
-        if ( nelems <= block->size ) {        /* Big enough */
-            if ( nelems < block->size ) {
-                block->size -= nelems;         /* Allocate tell end. */
-                block->used = 0;
-                block->next = NULL;         /* Mark as occupied */
-                block += block->size;
-                block->size = nelems;         /* block now == pointer to be alloc'd. */
-                block->used = 1;
-            } else {
-                if (prev==NULL) {
-                    r->free = block->next;
-                } else {
-                    prev->next = block->next;
-                }
+    MemFlushCache();
+    MemStats(&before,BATCHREGION);
+    n = MemAllocBatch(BATCHSIZE,BATCHBLOCKS,BATCHREGION,(void **) block);
+    if( n != BATCHBLOCKS )
+        errors++;
+    for(i=0;i<n;i++) {
+        if( !block[i] || MemSize(block[i]) < BATCHSIZE )
+            errors++;
+        else
+            memset(block[i],i,BATCHSIZE);
+    }
+    if( MemCheck(BATCHREGION) != 0 )
+        errors++;
+    for(i=0;i<n;i++) {
+        for(j=0;block[i] && j<BATCHSIZE;j++) {
+            if( block[i][j] != (unsigned char) i ) {
+                errors++;
+                break;
             }
-            r->memleft -= nelems;
-
-            /*
-             * Return a pointer past the header to the actual space requested.
-             */
-            return((void *)(block+1));
         }
     }
+    srand(3);
+    for(i=n-1;i>0;i--) {
+        k = rand()%(i+1);
+        block[BATCHBLOCKS] = block[i];
+        block[i] = block[k];
+        block[k] = block[BATCHBLOCKS];
+    }
+    block[n]   = NULL;
+    block[n+1] = NULL;
+    MemFreeBatch((void **) block,n+2);
+    if( MemCheck(BATCHREGION) != 0 )
+        errors++;
+    MemStats(&after,BATCHREGION);
+    if( after.usedblocks != before.usedblocks || after.freebytes != before.freebytes
+        || after.allocs != before.allocs+n || after.frees != before.frees+n )
+        errors++;
+    /* Larger than the region */
+    if( MemAllocBatch((MAXUNITS-1)*MEM_UNIT,2,BATCHREGION,(void **) block) != 0 )
+        errors++;
 
-    /* Area not found */
-    return NULL;
+    /* Holes for 3 blocks each, kept apart by used blocks */
+    for(i=0;i<BATCHHOLES;i++) {
+        hole[i] = MemAlloc(3*(BATCHSIZE+sizeof(HEADER)),BATCHREGION);
+        sep[i]  = MemAlloc(BATCHSIZE,BATCHREGION);
+    }
+    for(i=0;i<BATCHHOLES;i++)
+        MemFree(hole[i]);
+    MemFlushCache();
+    n = MemAllocBatch(BATCHSIZE,BATCHBLOCKS,BATCHREGION,(void **) block);
+    if( n != BATCHBLOCKS || MemCheck(BATCHREGION) != 0 )
+        errors++;
+    for(i=0;i<n;i++)
+        memset(block[i],i,BATCHSIZE);
+    for(i=0;i<n;i++) {
+        for(j=0;j<BATCHSIZE;j++) {
+            if( block[i][j] != (unsigned char) i ) {
+                errors++;
+                break;
+            }
+        }
+    }
+    MemFreeBatch((void **) block,n);
+    for(i=0;i<BATCHHOLES;i++)
+        MemFree(sep[i]);
+    MemFlushCache();
+    if( MemCheck(BATCHREGION) != 0 )
+        errors++;
+    MemStats(&after,BATCHREGION);
+    if( after.usedblocks != before.usedblocks )
+        errors++;
+    printf("Batch test: %d error(s)\n",errors);
+    return errors;
 }
 
+#define SIZEDREGION     1
+#define SIZEDBLOCKS     16
 
 /**
- *  @brief  MemStats
+ *  @brief  Sized free test
  *
- *  @note   Delivers allocation information
+ *  @note   Blocks freed with their size must leave the region as before. With
+ *          MEM_THREADCACHE, a block of the same size must be the last one freed.
  */
-void MemStats( MEMSTATS *stats, uint32_t region ) {
-REGION *r;
-HEADER *p;
-const uint32_t MAXBYTES = 1000000;   /* to avoid the inclusion of other headers */
+int TestSized(void) {
+void *block[SIZEDBLOCKS];
+#ifdef MEM_THREADCACHE
+void *p;
+#endif
+MEMSTATS before, after;
+size_t nb;
+uint32_t i;
+int errors = 0;
 
-    r = &Regions[region];
+    MemFlushCache();
+    MemStats(&before,SIZEDREGION);
+    for(i=0;i<SIZEDBLOCKS;i++)
+        block[i] = MemAlloc(1+i*20,SIZEDREGION);
+    /* Resized blocks are freed with the new size */
+    block[1] = MemRealloc(block[1],300);
+    block[2] = MemRealloc(block[2],3);
+    for(i=0;i<SIZEDBLOCKS;i++) {
+        nb = i == 1 ? 300 : i == 2 ? 3 : 1+i*20;
+        MemFreeSized(block[i],nb);
+#ifdef MEM_THREADCACHE
+        if( nb+sizeof(HEADER) <= MEM_CACHE_UNITS*MEM_UNIT ) {
+            p = MemAlloc(nb,SIZEDREGION);
+            if( p != block[i] )
+                errors++;
+            MemFreeSized(p,nb);
+        }
+#endif
+    }
+    MemFreeSized(NULL,0);
+    MemFlushCache();
+    if( MemCheck(SIZEDREGION) != 0 )
+        errors++;
+    MemStats(&after,SIZEDREGION);
+    if( after.usedblocks != before.usedblocks || after.freebytes != before.freebytes )
+        errors++;
+    printf("Sized free test: %d error(s)\n",errors);
+    return errors;
+}
 
-    stats->memleft     = r->memleft;
-    stats->freeblocks  = 0;
-    stats->freebytes   = 0;
-    stats->usedblocks  = 0;
-    stats->usedbytes   = 0;
-    stats->largestused = 0;
-    stats->smallestused= MAXBYTES;
-    stats->largestfree = 0;
-    stats->smallestfree= MAXBYTES;
+#ifdef MEM_BUDDY
+#define BUDDYREGION     2
+#define BUDDYAREASIZE   (65536+3000)
+#define BUDDYSLOTS      64
+#define BUDDYITERATIONS 20000
+#define BUDDYALIGN      1024
 
-    if( !r->free )
-        return;
+static uint32_t buddyarea[BUDDYAREASIZE/sizeof(uint32_t)+1];
 
-    for(p=r->free;p;p=p->next) {
-        stats->freeblocks++;
-        stats->freebytes += p->size;
-        if( p->size > stats->largestfree )
-            stats->largestfree = p->size;
-        if( p->size < stats->smallestfree )
-            stats->smallestfree = p->size;
-    }
+/**
+ *  @brief  Buddy region test
+ *
+ *  @note   The area is not aligned and not a power of two. Blocks must have
+ *          2^k units, be aligned to their size and all be combined again
+ *          when freed. A request of 2^k bytes must get a block of that size.
+ */
+int TestBuddy(void) {
+unsigned char *slot[BUDDYSLOTS];
+unsigned char *p, *q;
+uint32_t size[BUDDYSLOTS];
+void *batch[16];
+MEMSTATS before, after;
+size_t n;
+uint32_t i, j, k;
+int errors = 0;
 
-    for(p=r->start;(p < r->end)&&(p->size>0);p=p+p->size) {
-        if( p->used ) {
-            stats->usedblocks++;
-            stats->usedbytes += p->size;
-            if( p->size > stats->largestused )
-                stats->largestused = p->size;
-            if( p->size < stats->smallestused )
-                stats->smallestused = p->size;
+    MemAddRegionType(BUDDYREGION,buddyarea+1,BUDDYAREASIZE,MEM_REGION_BUDDY);
+    if( MemCheck(BUDDYREGION) != 0 )
+        errors++;
+    MemStats(&before,BUDDYREGION);
+    if( before.freebytes < BUDDYAREASIZE/2 || before.freeblocks < 2 )
+        errors++;
+    for(i=0;i<BUDDYSLOTS;i++)
+        slot[i] = NULL;
+
+    srand(5);
+    for(i=0;i<BUDDYITERATIONS;i++) {
+        k = rand()%BUDDYSLOTS;
+        if( slot[k] ) {
+            for(j=0;j<size[k];j++) {
+                if( slot[k][j] != (unsigned char) k ) {
+                    errors++;
+                    break;
+                }
+            }
+            MemFree(slot[k]);
+            slot[k] = NULL;
+        } else {
+            size[k] = rand()%(rand()%8?256:4096);
+            if( rand()%4 )
+                slot[k] = MemAlloc(size[k],BUDDYREGION);
+            else
+                slot[k] = MemAllocAligned(size[k],BUDDYALIGN,BUDDYREGION);
+            if( !slot[k] )
+                continue;
+            n = MemSize(slot[k]);
+            if( n < size[k] || (n&(n-1)) != 0 || ((uintptr_t) slot[k]&(n-1)) != 0 )
+                errors++;
+            memset(slot[k],k,size[k]);
+        }
+        if( (i%97) == 0 && MemCheck(BUDDYREGION) != 0 ) {
+            printf("MemCheck failed with %d at iteration %u\n",MemCheck(BUDDYREGION),i);
+            errors++;
+            break;
         }
     }
-    // To avoid "strange" numbers on output
-    if( stats->smallestfree == MAXBYTES )
-        stats->smallestfree = 0;
-    if( stats->smallestused == MAXBYTES )
-        stats->smallestused = 0;
-    // To report sizes in bytes
-    stats->freebytes    *= sizeof(HEADER);
-    stats->usedbytes    *= sizeof(HEADER);
-    stats->largestfree  *= sizeof(HEADER);
-    stats->largestused  *= sizeof(HEADER);
-    stats->smallestfree *= sizeof(HEADER);
-    stats->smallestused *= sizeof(HEADER);
-    stats->memleft      *= sizeof(HEADER);
+    for(k=0;k<BUDDYSLOTS;k++)
+        MemFree(slot[k]);
+
+    /* No header, so a page takes a block of a page */
+    p = MemAlloc(4096,BUDDYREGION);
+    if( !p || MemSize(p) != 4096 || ((uintptr_t) p&4095) != 0 )
+        errors++;
+    q = MemAllocAligned(4096,4096,BUDDYREGION);
+    if( !q || MemSize(q) != 4096 || ((uintptr_t) q&4095) != 0 )
+        errors++;
+    MemFree(p);
+    MemFreeSized(q,4096);
+
+    /* Shrunk in place, moved to grow */
+    p = MemAlloc(1000,BUDDYREGION);
+    q = MemRealloc(p,100);
+    if( !p || q != p || MemSize(q) >= 1000 )
+        errors++;
+    q = MemRealloc(q,3000);
+    if( !q || MemSize(q) < 3000 )
+        errors++;
+    MemFree(q);
 
+    n = MemAllocBatch(24,16,BUDDYREGION,batch);
+    if( n != 16 )
+        errors++;
+    MemFreeBatch(batch,n);
+
+    /* Already initialized */
+    MemAddRegionType(BUDDYREGION,buddyarea,BUDDYAREASIZE,MEM_REGION_LIST);
+    MemFlushCache();
+    if( MemCheck(BUDDYREGION) != 0 )
+        errors++;
+    MemStats(&after,BUDDYREGION);
+    if( after.usedblocks != 0 || after.freebytes != before.freebytes
+        || after.freeblocks != before.freeblocks )
+        errors++;
+    printf("Buddy test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestBuddy(void) {
+    return 0;
 }
+#endif
 
-#if defined(DEBUG) || defined(TEST)
+#ifdef MEM_BITMAP
+#define BITMAPREGION    3
+#define BITMAPAREASIZE  (32768+5)
+#define BITMAPSLOTS     64
+#define BITMAPITERATIONS 20000
+
+static uint32_t bitmaparea[BITMAPAREASIZE/sizeof(uint32_t)+1];
 
 /**
- *  @brief  Memory List
- *
- *  @note   List all memory blocks, including size and status
+ *  @brief  Bitmap region test
  *
+ *  @note   The area is not aligned. After random allocations, reallocations
+ *          and frees, the popcounts of MemStats must match the walk of
+ *          MemStatsDeep, and all free units must be one run again.
  */
-void MemList(uint32_t region) {
-uint32_t i;
-HEADER *p;
-REGION *r;
+int TestBitmap(void) {
+unsigned char *slot[BITMAPSLOTS];
+unsigned char *p, *q;
+uint32_t size[BITMAPSLOTS];
+void *batch[16];
+MEMSTATS before, after, deep;
+size_t n;
+uint32_t i, j, k;
+int errors = 0;
 
-    r = &Regions[region];
+    MemAddRegionType(BITMAPREGION,(char *) bitmaparea+1,BITMAPAREASIZE,MEM_REGION_BITMAP);
+    if( MemCheck(BITMAPREGION) != 0 )
+        errors++;
+    MemStats(&before,BITMAPREGION);
+    if( before.freebytes < BITMAPAREASIZE*7/8 || before.freeblocks != 1 )
+        errors++;
+    for(i=0;i<BITMAPSLOTS;i++)
+        slot[i] = NULL;
 
-    for(i=0,p=r->start;(p<r->end)&&(p->size>0);i++,p=p+p->size) {
-        printf("B%02u (%c): %u @%p (next=%p)\n",i,p->used?'U':'F',
-                    (uint32_t) (p->size*sizeof(HEADER)),p,p->next);
+    srand(7);
+    for(i=0;i<BITMAPITERATIONS;i++) {
+        k = rand()%BITMAPSLOTS;
+        if( slot[k] ) {
+            for(j=0;j<size[k];j++) {
+                if( slot[k][j] != (unsigned char) k ) {
+                    errors++;
+                    break;
+                }
+            }
+            if( rand()%4 ) {
+                MemFree(slot[k]);
+                slot[k] = NULL;
+                continue;
+            }
+            /* Grown in place when the units after it are free */
+            n = 1+rand()%1023;
+            p = MemRealloc(slot[k],n);
+            if( !p )
+                continue;
+            slot[k] = p;
+            if( n > size[k] )
+                memset(p+size[k],k,n-size[k]);
+            size[k] = n;
+        } else {
+            size[k] = rand()%(rand()%8?256:2048);
+            if( rand()%4 )
+                slot[k] = MemAlloc(size[k],BITMAPREGION);
+            else
+                slot[k] = MemAllocAligned(size[k],256,BITMAPREGION);
+            if( !slot[k] )
+                continue;
+            if( MemSize(slot[k]) < size[k] )
+                errors++;
+            memset(slot[k],k,size[k]);
+        }
+        if( (i%97) == 0 ) {
+            if( MemCheck(BITMAPREGION) != 0 ) {
+                printf("MemCheck failed with %d at iteration %u\n",MemCheck(BITMAPREGION),i);
+                errors++;
+                break;
+            }
+            MemStatsDeep(&deep,BITMAPREGION);
+            MemStats(&after,BITMAPREGION);
+            if( after.freebytes != deep.freebytes || after.freeblocks != deep.freeblocks )
+                errors++;
+        }
     }
-    putchar('\n');
-}
+    for(k=0;k<BITMAPSLOTS;k++)
+        MemFree(slot[k]);
+    MemFlushCache();
+
+    /* Shrunk and grown again in place */
+    p = MemAlloc(1000,BITMAPREGION);
+    q = MemRealloc(p,100);
+    if( !p || q != p || MemSize(q) >= 1000 )
+        errors++;
+    q = MemRealloc(q,3000);
+    if( q != p || MemSize(q) < 3000 )
+        errors++;
+    MemFree(q);
 
+    n = MemAllocBatch(24,16,BITMAPREGION,batch);
+    if( n != 16 )
+        errors++;
+    MemFreeBatch(batch,n);
+
+    MemFlushCache();
+    if( MemCheck(BITMAPREGION) != 0 )
+        errors++;
+    MemStats(&after,BITMAPREGION);
+    if( after.usedblocks != 0 || after.freebytes != before.freebytes || after.freeblocks != 1 )
+        errors++;
+    printf("Bitmap test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestBitmap(void) {
+    return 0;
+}
 #endif
 
-//////////////////////// TEST  ///////////////////////////////////////////////////////////////////
+#ifdef MEM_SLAB
+#define SLABREGION      1
+#define SLABAREASIZE    (16*MEM_SLAB_BYTES)
+#define SLABOBJECTS     2000
 
-#ifdef TEST
-#include <stdio.h>
+static uint32_t slabarea[SLABAREASIZE/sizeof(uint32_t)];
 
-void PrintStats(char *msg, MEMSTATS *stats ) {
+#define INSLAB(P)       ((char *)(P) >= (char *) slabarea && (char *)(P) < (char *) slabarea+SLABAREASIZE)
+#define SLABSIZE(I)     (8+((I)%5)*((MEM_SLAB_MAX-8)/4))
 
-    puts(msg);
-    printf("Free blocks      = %u\n",stats->freeblocks);
-    printf("Free bytes       = %u\n",stats->freebytes);
-    printf("Smallest free    = %u\n",stats->smallestfree);
-    printf("Largest free     = %u\n",stats->largestfree);
-    printf("Used blocks      = %u\n",stats->usedblocks);
-    printf("Used bytes       = %u\n",stats->usedbytes);
-    printf("Smallest used    = %u\n",stats->smallestused);
-    printf("Largest used     = %u\n",stats->largestused);
-    printf("Memory left      = %u\n",stats->memleft);
+/**
+ *  @brief  Slab test
+ *
+ *  @note   Slabs are added to region 1 after the other tests of the region.
+ *          Small objects must come from them until they are all used, then
+ *          from the blocks of the region, as larger objects do.
+ */
+int TestSlab(void) {
+unsigned char *obj[SLABOBJECTS];
+void *batch[8];
+unsigned char *p;
+MEMSTATS before, after;
+uint32_t i, j, n;
+int errors = 0;
 
-}
+    MemFlushCache();
+    MemStats(&before,SLABREGION);
+    MemAddRegionType(SLABREGION,slabarea,SLABAREASIZE,MEM_REGION_SLAB);
 
-#define BUFFERSIZE 160
+    for(n=0;n<SLABOBJECTS;) {
+        obj[n] = MemAlloc(SLABSIZE(n),SLABREGION);
+        if( !obj[n] || MemSize(obj[n]) < SLABSIZE(n) ) {
+            errors++;
+            break;
+        }
+        memset(obj[n],n,SLABSIZE(n));
+        /* Slabs used up */
+        if( !INSLAB(obj[n]) ) {
+            n++;
+            break;
+        }
+        n++;
+    }
+    if( n < 2 || n == SLABOBJECTS )
+        errors++;
+    if( MemCheck(SLABREGION) != 0 )
+        errors++;
+    MemStats(&after,SLABREGION);
+    if( after.slabobjects != n-1 )
+        errors++;
 
-static uint32_t buffer[(BUFFERSIZE+sizeof(uint32_t)-1)/sizeof(uint32_t)];
+    p = MemAlloc(MEM_SLAB_MAX+1,SLABREGION);
+    if( !p || INSLAB(p) )
+        errors++;
+    MemFree(p);
+
+    /* In place while it fits, then moved out of the slabs */
+    if( MemRealloc(obj[0],1) != obj[0] )
+        errors++;
+    obj[1] = MemRealloc(obj[1],2*MEM_SLAB_MAX);
+    if( !obj[1] || INSLAB(obj[1]) )
+        errors++;
+    for(i=0;i<n;i++) {
+        for(j=0;obj[i] && j<(i==0?1:SLABSIZE(i));j++) {
+            if( obj[i][j] != (unsigned char) i ) {
+                errors++;
+                break;
+            }
+        }
+    }
+
+    for(i=0;i<n;i+=2) {
+        MemFreeSized(obj[i],i==0?1:SLABSIZE(i));
+        obj[i] = NULL;
+    }
+    MemFreeBatch((void **) obj,n);
 
+    if( MemAllocBatch(24,8,SLABREGION,batch) != 8 )
+        errors++;
+    for(i=0;i<8;i++) {
+        if( !INSLAB(batch[i]) )
+            errors++;
+    }
+    MemFreeBatch(batch,8);
+
+    MemFlushCache();
+    if( MemCheck(SLABREGION) != 0 )
+        errors++;
+    MemStats(&after,SLABREGION);
+    if( after.slabobjects != 0 || after.slabbytes != 0
+        || after.usedblocks != before.usedblocks || after.freebytes != before.freebytes )
+        errors++;
+    printf("Slab test: %d error(s)\n",errors);
+    return errors;
+}
+#else
+int TestSlab(void) {
+    return 0;
+}
+#endif
 
 int main(void) {
 char *p1,*p2,*p3;
 MEMSTATS stats;
+int errors;
 
     printf("Size of block HEADER = %u\n",(uint32_t) sizeof(HEADER));
+    printf("Allocation unit      = %u\n",(uint32_t) MEM_UNIT);
     printf("Size of heap area    = %u\n",(uint32_t) BUFFERSIZE);
 
     MemInit(buffer,BUFFERSIZE);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Inicialized",&stats);
     MemList(0);
 
     p1 = MemAlloc(10,0);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Allocation #1",&stats);
     MemList(0);
 
     p2 = MemAlloc(10,0);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Allocation #2",&stats);
     MemList(0);
 
     p3 = MemAlloc(10,0);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Allocation #3",&stats);
     MemList(0);
 
     MemFree(p2);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Free #2",&stats);
     MemList(0);
 
     MemFree(p3);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Free #3",&stats);
     MemList(0);
 
     MemFree(p1);
-    MemStats(&stats,0);
+    MemStatsDeep(&stats,0);
     PrintStats("Free #3",&stats);
     MemList(0);
 
+    errors  = TestGrowable();
+    errors += TestRandom();
+    errors += TestTrim();
+    errors += TestInstrument();
+    errors += TestFragmentation();
+    errors += TestRealloc();
+    errors += TestAligned();
+    errors += TestBatch();
+    errors += TestSized();
+    errors += TestBuddy();
+    errors += TestBitmap();
+    errors += TestSlab();
+    errors += TestLarge();
+#ifndef DEBUG
+    TestTiming();
+#if defined(MEM_THREADS)
+    errors += TestThreads();
+#endif
+#endif
+    return errors;
 }
 #endif
@@ -6,6 +6,7 @@
  *  @brief  header file for memmanager
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -13,26 +14,99 @@
  */
 
 typedef struct memstats {
-    uint32_t freebytes;                 ///< Size (in bytes) of total free area
-    uint32_t usedbytes;                 ///< Size (in bytes) of total used area
-    uint32_t freeblocks;                ///< Number of free blocks
-    uint32_t usedblocks;                ///< Number of used blocks
-    uint32_t memleft;                   ///< Should be the same of freebytes
-    uint32_t largestused;               ///< Largest used block
-    uint32_t smallestused;              ///< Smalles used block
-    uint32_t largestfree;               ///< Largest free block
-    uint32_t smallestfree;              ///< Smalles free block
+    size_t   freebytes;                 ///< Size (in bytes) of total free area
+    size_t   usedbytes;                 ///< Size (in bytes) of total used area
+    size_t   freeblocks;                ///< Number of free blocks
+    size_t   usedblocks;                ///< Number of used blocks
+    size_t   memleft;                   ///< Should be the same of freebytes
+    size_t   largestused;               ///< Largest used block
+    size_t   smallestused;              ///< Smalles used block
+    size_t   largestfree;               ///< Largest free block
+    size_t   smallestfree;              ///< Smalles free block
+    size_t   maxusedbytes;              ///< Highest used area (in bytes)
+    uint64_t allocs;                    ///< Number of blocks taken from the free list(s)
+    uint64_t frees;                     ///< Number of blocks returned to the free list(s)
+    size_t   slabobjects;               ///< Objects used in slabs
+    size_t   slabbytes;                 ///< Bytes of the objects used in slabs
 } MEMSTATS;
 
+/**
+ *  @brief  Histograms of a region (MEM_INSTRUMENT)
+ *
+ *  @note   Bucket 0 counts the value 0 and bucket i the values in [2^(i-1),2^i)
+ *
+ *  @note   All entry points are counted. Allocations are MemAlloc,
+ *          MemAllocAligned, MemAllocBatch and MemRealloc, and frees are
+ *          MemFree, MemFreeSized, MemFreeBatch and MemRealloc to zero bytes.
+ *          Each block of a batch counts the mean cycles of the call.
+ */
+#define MEM_HISTBUCKETS 32
+
+typedef struct memhist {
+    uint64_t size[MEM_HISTBUCKETS];     ///< Bytes requested by the allocations
+    uint64_t alloc[MEM_HISTBUCKETS];    ///< Cycles of the allocations
+    uint64_t free[MEM_HISTBUCKETS];     ///< Cycles of the frees
+} MEMHIST;
+
+
+/**
+ *  @brief  Fragmentation of a region
+ *
+ *  @note   Ratios are in thousandths. freehist counts free blocks as MEMHIST
+ *          does, by size in bytes.
+ *
+ *  @note   internal is MEM_FRAGUNKNOWN when the bytes requested are not
+ *          recorded (without MEM_INSTRUMENT)
+ */
+#define MEM_FRAGUNKNOWN 0xFFFFFFFFU
+
+typedef struct memfrag {
+    size_t   freebytes;                 ///< Size (in bytes) of total free area
+    size_t   freeblocks;                ///< Number of free blocks
+    size_t   largestfree;               ///< Largest free block
+    size_t   fits;                      ///< Number of allocations of the given size that fit
+    uint32_t external;                  ///< 1 - largest free block / free area
+    uint32_t internal;                  ///< 1 - bytes requested / bytes allocated
+    size_t   freehist[MEM_HISTBUCKETS]; ///< Free blocks by size
+} MEMFRAG;
+
+/**
+ *  @brief  Region types for MemAddRegionType
+ *
+ *  @note   MEM_REGION_LIST is the free list organization chosen at compile
+ *          time and the one of MemAddRegion. MEM_REGION_BUDDY needs MEM_BUDDY.
+ *          MEM_REGION_SLAB, with MEM_SLAB, adds slabs to a region of the other
+ *          types, and MemAlloc takes small objects from them.
+ *          MEM_REGION_BITMAP needs MEM_BITMAP.
+ */
+#define MEM_REGION_LIST     0           ///< Free list(s) of blocks of any size
+#define MEM_REGION_BUDDY    1           ///< Binary buddy blocks of 2^k units
+#define MEM_REGION_SLAB     2           ///< Slabs of small objects, added to a region
+#define MEM_REGION_BITMAP   3           ///< Blocks of any size found in a bitmap of units
 
 /**
  *  @brief  Function prototypes
  */
 
-void MemAddRegion( uint32_t region, void *area, uint32_t size );
-void MemInit( void *area, uint32_t size) ;
+void MemAddRegion( uint32_t region, void *area, size_t size );
+void MemAddRegionType( uint32_t region, void *area, size_t size, uint32_t type );
+int32_t MemAddGrowableRegion( uint32_t region, size_t reserve, size_t initial );
+void MemInit( void *area, size_t size) ;
 void MemFree( void *p );
-void *MemAlloc( uint32_t nb, uint32_t index );
+void MemFreeSized( void *p, size_t nb );
+void *MemAlloc( size_t nb, uint32_t index );
+void *MemAllocAligned( size_t nb, size_t align, uint32_t region );
+void *MemRealloc( void *p, size_t nb );
+size_t MemAllocBatch( size_t nb, size_t count, uint32_t region, void **out );
+void MemFreeBatch( void **ptrs, size_t count );
 void MemStats( MEMSTATS *stats, uint32_t region );
+void MemStatsDeep( MEMSTATS *stats, uint32_t region );
+void MemHistogram( MEMHIST *hist, uint32_t region );
+void MemFragmentation( MEMFRAG *frag, uint32_t region, size_t nb );
+void MemFlushCache( void );
+void MemLockAll( void );
+void MemUnlockAll( void );
+size_t MemSize( void *p );
+size_t MemTrim( uint32_t region );
 
 #endif  // MEMMANAGER_H
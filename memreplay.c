@@ -0,0 +1,345 @@
+/**
+ *  @file   memreplay.c
+ *
+ *  @brief  Replay of allocation traces against MemAlloc and MemFree
+ *
+ *  @note   A trace is a text file with one event in each line:
+ *              a <id> <size> <region> <time>   allocation of size bytes
+ *              f <id> <time>                   free of the block allocated as id
+ *          Ids are any integer (memtrace.so uses the addresses). Times are in
+ *          nanoseconds and are only used to report the length of the trace.
+ *          Lines starting with # are ignored.
+ *
+ *  @note   Reports throughput, percentiles of the cycles of each call, the
+ *          peak footprint and, every interval events, the fragmentation of
+ *          each region.
+ *
+ *  @note   Usage: memreplay [-s regionsize] [-i interval] [-g events] [file]
+ *              -g writes a synthetic trace with that many events to stdout
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memmanager.h"
+
+/// Number of regions that a trace can use
+#define REPLAYREGIONS   4
+
+/**
+ *  @brief  Trace event
+ *
+ *  @note   When loaded, the id of a free is replaced by the index of the
+ *          allocation event, so the replay needs no lookup
+ */
+typedef struct event {
+    char        op;                     ///< 'a' for MemAlloc, 'f' for MemFree
+    uint32_t    region;                 ///< Region of an allocation
+    uint64_t    id;                     ///< Block id, then index of the allocation
+    uint64_t    time;                   ///< Time of the event in the trace
+    size_t      size;                   ///< Bytes requested
+} EVENT;
+
+static EVENT   *Events;
+static size_t   NEvents;
+
+static uint64_t Cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+#endif
+}
+
+static double Seconds(void) {
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+/**
+ *  @brief  Table of the live ids while loading
+ *
+ *  @note   Open addressing with linear probing. Freed entries are marked and
+ *          not reused, so the table needs twice the number of allocations.
+ */
+///@{
+#define IDEMPTY         0
+#define IDLIVE          1
+#define IDFREED         2
+
+typedef struct identry {
+    uint64_t    id;
+    uint64_t    index;
+    uint32_t    state;
+} IDENTRY;
+
+static IDENTRY *Ids;
+static uint64_t IdMask;
+
+static IDENTRY *IdFind(uint64_t id, int insert) {
+uint64_t h;
+
+    h = (id*0x9E3779B97F4A7C15ULL)>>17;
+    for(;;h++) {
+        h &= IdMask;
+        if( Ids[h].state == IDEMPTY )
+            return insert ? &Ids[h] : NULL;
+        if( Ids[h].state == IDLIVE && Ids[h].id == id )
+            return &Ids[h];
+    }
+}
+///@}
+
+/**
+ *  @brief  Load a trace
+ *
+ *  @note   Frees of unknown ids (blocks allocated before the capture) are
+ *          dropped. Returns the number of dropped events.
+ */
+static size_t Load(FILE *f) {
+char line[256];
+EVENT e;
+IDENTRY *id;
+size_t n, nalloc, dropped, cap;
+unsigned long long a, b, c, d;
+
+    cap = 1024;
+    Events = malloc(cap*sizeof(EVENT));
+    NEvents = 0;
+    nalloc = 0;
+    while( fgets(line,sizeof(line),f) ) {
+        memset(&e,0,sizeof(e));
+        if( sscanf(line,"a %llu %llu %llu %llu",&a,&b,&c,&d) == 4 ) {
+            e.op = 'a';
+            e.id = a;
+            e.size = b;
+            e.region = c;
+            e.time = d;
+            nalloc++;
+        } else if( sscanf(line,"f %llu %llu",&a,&b) == 2 ) {
+            e.op = 'f';
+            e.id = a;
+            e.time = b;
+        } else {
+            continue;
+        }
+        if( NEvents == cap ) {
+            cap *= 2;
+            Events = realloc(Events,cap*sizeof(EVENT));
+        }
+        Events[NEvents++] = e;
+    }
+
+    for(n=2;n<2*nalloc;n*=2)
+        ;
+    Ids = calloc(n,sizeof(IDENTRY));
+    IdMask = n-1;
+    dropped = 0;
+    for(n=0;n<NEvents;n++) {
+        if( Events[n].op == 'a' ) {
+            if( Events[n].region >= REPLAYREGIONS )
+                Events[n].region = 0;
+            /* An id allocated twice leaks the first block */
+            if( (id = IdFind(Events[n].id,0)) != NULL )
+                id->state = IDFREED;
+            id = IdFind(Events[n].id,1);
+            id->id = Events[n].id;
+            id->state = IDLIVE;
+            id->index = Events[n].id = n;
+        } else {
+            if( (id = IdFind(Events[n].id,0)) == NULL ) {
+                Events[n].op = 0;
+                dropped++;
+                continue;
+            }
+            id->state = IDFREED;
+            Events[n].id = id->index;
+        }
+    }
+    free(Ids);
+    return dropped;
+}
+
+/**
+ *  @brief  Write a synthetic trace
+ *
+ *  @note   Mostly small blocks with some large ones, and up to 4096 live blocks
+ */
+static void Generate(size_t nevents) {
+uint64_t live[4096];
+uint64_t next = 1, t = 0;
+size_t i, k, size;
+
+    memset(live,0,sizeof(live));
+    srand(1);
+    printf("# synthetic trace\n");
+    for(i=0;i<nevents;i++) {
+        k = rand()%4096;
+        t += rand()%1000;
+        if( live[k] ) {
+            printf("f %llu %llu\n",(unsigned long long) live[k],(unsigned long long) t);
+            live[k] = 0;
+        } else {
+            size = rand()%(rand()%16?128:8192);
+            live[k] = next++;
+            printf("a %llu %zu %u %llu\n",(unsigned long long) live[k],size,
+                    (unsigned) (k%REPLAYREGIONS==0),(unsigned long long) t);
+        }
+    }
+}
+
+static int CompareCycles(const void *a, const void *b) {
+uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void Percentiles(char *name, uint64_t *c, size_t n) {
+
+    if( n == 0 )
+        return;
+    qsort(c,n,sizeof(uint64_t),CompareCycles);
+    printf("%s cycles: p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",name,
+            (unsigned long long) c[n/2],(unsigned long long) c[n*9/10],
+            (unsigned long long) c[n*99/100],(unsigned long long) c[n*999/1000],
+            (unsigned long long) c[n-1]);
+}
+
+/**
+ *  @brief  Print the fragmentation of the regions used
+ */
+static void Sample(size_t n, int *used) {
+MEMSTATS stats;
+MEMFRAG frag;
+uint32_t r;
+
+    for(r=0;r<REPLAYREGIONS;r++) {
+        if( !used[r] )
+            continue;
+        MemStats(&stats,r);
+        MemFragmentation(&frag,r,0);
+        printf("sample %zu region %u used %zu free %zu largest %zu external %u",
+                n,r,stats.usedbytes,stats.freebytes,frag.largestfree,frag.external);
+        if( frag.internal != MEM_FRAGUNKNOWN )
+            printf(" internal %u",frag.internal);
+        printf("\n");
+    }
+}
+
+/**
+ *  @brief  Replay the trace loaded
+ */
+static void Replay(size_t regionsize, size_t interval) {
+void **block;
+uint64_t *acycles, *fcycles;
+size_t na = 0, nf = 0, failed = 0, n, peak = 0;
+uint64_t t;
+double elapsed = 0, t0;
+int used[REPLAYREGIONS];
+MEMSTATS stats;
+uint32_t r;
+void *area;
+
+    memset(used,0,sizeof(used));
+    for(n=0;n<NEvents;n++) {
+        if( Events[n].op == 'a' )
+            used[Events[n].region] = 1;
+    }
+    for(r=0;r<REPLAYREGIONS;r++) {
+        if( !used[r] || MemAddGrowableRegion(r,regionsize,65536) == 0 )
+            continue;
+        area = malloc(regionsize);
+        if( !area ) {
+            fprintf(stderr,"No memory for region %u\n",r);
+            exit(1);
+        }
+        MemAddRegion(r,area,regionsize);
+    }
+
+    block   = calloc(NEvents,sizeof(void *));
+    acycles = malloc(NEvents*sizeof(uint64_t));
+    fcycles = malloc(NEvents*sizeof(uint64_t));
+
+    t0 = Seconds();
+    for(n=0;n<NEvents;n++) {
+        if( Events[n].op == 'a' ) {
+            t = Cycles();
+            block[n] = MemAlloc(Events[n].size,Events[n].region);
+            acycles[na++] = Cycles()-t;
+            if( !block[n] )
+                failed++;
+        } else if( Events[n].op == 'f' ) {
+            t = Cycles();
+            MemFree(block[Events[n].id]);
+            fcycles[nf++] = Cycles()-t;
+            block[Events[n].id] = NULL;
+        }
+        if( interval && (n+1)%interval == 0 ) {
+            elapsed += Seconds()-t0;
+            Sample(n+1,used);
+            t0 = Seconds();
+        }
+    }
+    elapsed += Seconds()-t0;
+
+    for(r=0;r<REPLAYREGIONS;r++) {
+        MemStats(&stats,r);
+        peak += stats.maxusedbytes;
+    }
+    printf("events %zu allocs %zu frees %zu failed %zu\n",NEvents,na,nf,failed);
+    if( NEvents )
+        printf("trace length %.3f s\n",Events[NEvents-1].time*1e-9);
+    printf("replay %.6f s, %.0f ops/s\n",elapsed,elapsed>0?(na+nf)/elapsed:0.0);
+    Percentiles("MemAlloc",acycles,na);
+    Percentiles("MemFree ",fcycles,nf);
+    printf("peak footprint %zu bytes\n",peak);
+
+    free(block);
+    free(acycles);
+    free(fcycles);
+}
+
+int main(int argc, char *argv[]) {
+size_t regionsize = 64*1024*1024;
+size_t interval = 0, dropped;
+FILE *f = stdin;
+int c;
+
+    while( (c = getopt(argc,argv,"s:i:g:")) != -1 ) {
+        switch( c ) {
+        case 's':
+            regionsize = strtoull(optarg,NULL,0);
+            break;
+        case 'i':
+            interval = strtoull(optarg,NULL,0);
+            break;
+        case 'g':
+            Generate(strtoull(optarg,NULL,0));
+            return 0;
+        default:
+            fprintf(stderr,"Usage: %s [-s regionsize] [-i interval] [-g events] [file]\n",argv[0]);
+            return 1;
+        }
+    }
+    if( optind < argc && (f = fopen(argv[optind],"r")) == NULL ) {
+        perror(argv[optind]);
+        return 1;
+    }
+    dropped = Load(f);
+    if( dropped )
+        printf("dropped %zu frees of unknown blocks\n",dropped);
+    Replay(regionsize,interval);
+    return 0;
+}
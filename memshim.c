@@ -0,0 +1,185 @@
+/**
+ *  @file   memshim.c
+ *
+ *  @brief  malloc interface on top of MemAlloc and MemFree
+ *
+ *  @note   Built with memmanager.c as libmemmanager.so, it replaces the C
+ *          library allocator of unmodified programs:
+ *              LD_PRELOAD=./libmemmanager.so program
+ *
+ *  @note   memmanager.c must be compiled with MEM_GROWABLE, MEM_THREADS and a
+ *          MEM_UNIT of at least 16, so blocks have the alignment of malloc.
+ *          MEM_HEADER64 gives enough regions.
+ *
+ *  @note   Each thread allocates from one of SHIMREGIONS growable regions,
+ *          reserved when the first allocation is done. The regions only use
+ *          mmap, so nothing is allocated while they are created.
+ *
+ *  @note   Blocks with an alignment larger than MEM_UNIT are allocated with
+ *          MemAllocAligned, so all pointers are freed by MemFree.
+ *
+ *  @note   All region locks are taken before fork and released after it, in
+ *          the parent and in the child.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memmanager.h"
+
+/// Number of regions used
+#ifndef SHIMREGIONS
+#define SHIMREGIONS     8
+#endif
+/// Address space reserved for each region
+#ifndef SHIMRESERVE
+#define SHIMRESERVE     (((size_t)16)<<30)
+#endif
+/// Memory committed to each region at start
+#define SHIMINITIAL     (256*1024)
+/// Alignment of all blocks
+#define SHIMALIGN       16
+
+/**
+ *  @brief  Initialization
+ *
+ *  @note   States: 0 not initialized, 1 being initialized, 2 ready
+ */
+///@{
+static atomic_int ShimState;
+static atomic_uint ShimNext;
+static __thread uint32_t ShimRegion = ~0U;
+///@}
+
+static void ShimInit(void) {
+int expected = 0;
+uint32_t i;
+
+    if( atomic_load_explicit(&ShimState,memory_order_acquire) == 2 )
+        return;
+    if( atomic_compare_exchange_strong(&ShimState,&expected,1) ) {
+        for(i=0;i<SHIMREGIONS;i++)
+            MemAddGrowableRegion(i,SHIMRESERVE,SHIMINITIAL);
+        atomic_store_explicit(&ShimState,2,memory_order_release);
+        /* It may allocate, so only when ready */
+        pthread_atfork(MemLockAll,MemUnlockAll,MemUnlockAll);
+        return;
+    }
+    while( atomic_load_explicit(&ShimState,memory_order_acquire) != 2 )
+        sched_yield();
+}
+
+/**
+ *  @brief  Allocate nb bytes aligned to align, a power of two, from the region
+ *          of the calling thread, or from another one when it is full
+ */
+static void *ShimAlloc(size_t nb, size_t align) {
+uint32_t i, r;
+void *p;
+
+    ShimInit();
+    if( ShimRegion == ~0U )
+        ShimRegion = atomic_fetch_add(&ShimNext,1)%SHIMREGIONS;
+    r = ShimRegion;
+    if( nb == 0 )
+        nb = 1;
+    p = MemAllocAligned(nb,align,r);
+    for(i=1;!p && i<SHIMREGIONS;i++)
+        p = MemAllocAligned(nb,align,(r+i)%SHIMREGIONS);
+    if( !p )
+        errno = ENOMEM;
+    return p;
+}
+
+void *malloc(size_t nb) {
+
+    return ShimAlloc(nb,SHIMALIGN);
+}
+
+void free(void *p) {
+
+    MemFree(p);
+}
+
+void *calloc(size_t n, size_t size) {
+void *p;
+
+    if( size && n > ~(size_t)0/size ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    p = ShimAlloc(n*size,SHIMALIGN);
+    if( p )
+        memset(p,0,n*size);
+    return p;
+}
+
+void *realloc(void *old, size_t nb) {
+size_t size;
+void *p;
+
+    if( !old )
+        return ShimAlloc(nb,SHIMALIGN);
+    if( nb == 0 ) {
+        MemFree(old);
+        return NULL;
+    }
+    if( (p = MemRealloc(old,nb)) != NULL )
+        return p;
+    /* The region of the block is full */
+    p = ShimAlloc(nb,SHIMALIGN);
+    if( !p )
+        return NULL;
+    size = MemSize(old);
+    memcpy(p,old,size < nb ? size : nb);
+    MemFree(old);
+    return p;
+}
+
+int posix_memalign(void **pp, size_t align, size_t nb) {
+void *p;
+
+    if( align < sizeof(void *) || (align&(align-1)) != 0 )
+        return EINVAL;
+    p = ShimAlloc(nb,align);
+    if( !p )
+        return ENOMEM;
+    *pp = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t nb) {
+
+    if( align == 0 || (align&(align-1)) != 0 ) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ShimAlloc(nb,align);
+}
+
+void *memalign(size_t align, size_t nb) {
+
+    return aligned_alloc(align,nb);
+}
+
+void *valloc(size_t nb) {
+
+    return ShimAlloc(nb,sysconf(_SC_PAGESIZE));
+}
+
+void *pvalloc(size_t nb) {
+size_t page = sysconf(_SC_PAGESIZE);
+
+    return ShimAlloc((nb+page-1)&~(page-1),page);
+}
+
+size_t malloc_usable_size(void *p) {
+
+    return MemSize(p);
+}
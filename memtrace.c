@@ -0,0 +1,371 @@
+/**
+ *  @file   memtrace.c
+ *
+ *  @brief  Capture of allocation traces through LD_PRELOAD
+ *
+ *  @note   Build as a shared library and preload it in the program to trace:
+ *              LD_PRELOAD=./memtrace.so MEMTRACE_FILE=trace.txt program
+ *          Without MEMTRACE_FILE, the trace goes to memtrace.<pid>.txt.
+ *
+ *  @note   A child created by fork writes its own trace, to memtrace.<pid>.txt
+ *          or to MEMTRACE_FILE followed by .<pid>, without the events buffered
+ *          by the parent.
+ *
+ *  @note   Writes the format read by memreplay, with the addresses of the
+ *          blocks as ids and region 0. realloc is traced as a free and an
+ *          allocation. memalign, valloc and pvalloc are traced with the size
+ *          requested.
+ *
+ *  @note   Events are formatted without calling the C library and appended to
+ *          a buffer under a mutex. A free is written before the block is
+ *          returned, so it comes before any allocation that reuses the address.
+ *
+ *  @note   dlsym may allocate before the real functions are known. Those
+ *          requests are served from a static buffer and never freed. Other
+ *          threads wait until the initialization is done.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void *(*RealMalloc)(size_t);
+static void  (*RealFree)(void *);
+static void *(*RealCalloc)(size_t, size_t);
+static void *(*RealRealloc)(void *, size_t);
+static int   (*RealPosixMemalign)(void **, size_t, size_t);
+static void *(*RealAlignedAlloc)(size_t, size_t);
+static void *(*RealMemalign)(size_t, size_t);
+static void *(*RealValloc)(size_t);
+static void *(*RealPvalloc)(size_t);
+
+/**
+ *  @brief  Bootstrap area for the allocations done by dlsym
+ */
+///@{
+#define BOOTSTRAPSIZE   8192
+
+static char Bootstrap[BOOTSTRAPSIZE] __attribute__((aligned(16)));
+static size_t BootstrapUsed;
+
+#define ISBOOTSTRAP(P)  ((char *)(P) >= Bootstrap && (char *)(P) < Bootstrap+BOOTSTRAPSIZE)
+
+static void *BootstrapAlloc(size_t size) {
+void *p;
+
+    size = (size+15)&~(size_t)15;
+    if( BootstrapUsed+size > BOOTSTRAPSIZE )
+        return NULL;
+    p = Bootstrap+BootstrapUsed;
+    BootstrapUsed += size;
+    return p;
+}
+///@}
+
+/**
+ *  @brief  Trace buffer
+ */
+///@{
+#define TRACEBUFFER     65536
+
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static char TraceBuffer[TRACEBUFFER];
+static size_t TraceUsed;
+static int TraceFd = -1;
+static const char *TraceFile;       ///< MEMTRACE_FILE, or NULL
+static uint64_t TraceStart;
+static __thread int Inside;         ///< Set while the tracer itself runs
+///@}
+
+/**
+ *  @brief  Initialization
+ *
+ *  @note   States: 0 not initialized, 1 being initialized, 2 ready
+ */
+///@{
+static atomic_int TraceState;
+
+#define READY()         (atomic_load_explicit(&TraceState,memory_order_acquire) == 2)
+///@}
+
+static uint64_t Now(void) {
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/// Append the decimal digits of v to s
+static char *Number(char *s, uint64_t v) {
+char digits[24];
+int n = 0;
+
+    do {
+        digits[n++] = '0'+v%10;
+        v /= 10;
+    } while( v );
+    while( n > 0 )
+        *s++ = digits[--n];
+    return s;
+}
+
+static void Flush(void) {
+size_t done = 0;
+ssize_t n;
+
+    while( TraceFd >= 0 && done < TraceUsed ) {
+        n = write(TraceFd,TraceBuffer+done,TraceUsed-done);
+        if( n <= 0 )
+            break;
+        done += n;
+    }
+    TraceUsed = 0;
+}
+
+/**
+ *  @brief  Open the trace file
+ *
+ *  @note   The name has the pid unless MEMTRACE_FILE is set and this is not
+ *          a child. Only calls that are safe after a fork are used.
+ */
+static void Open(int child) {
+char name[256], *s;
+size_t n;
+
+    if( TraceFile && !child ) {
+        TraceFd = open(TraceFile,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+        return;
+    }
+    s = name;
+    if( TraceFile && (n = strlen(TraceFile)) < sizeof(name)-24 ) {
+        memcpy(s,TraceFile,n);
+        s[n] = '.';
+        s = Number(s+n+1,getpid());
+        *s = '\0';
+    } else {
+        memcpy(s,"memtrace.",9);
+        s = Number(s+9,getpid());
+        memcpy(s,".txt",5);
+    }
+    TraceFd = open(name,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+}
+
+/**
+ *  @brief  Fork handlers
+ *
+ *  @note   The lock is held across fork, so the buffer is not copied in the
+ *          middle of an event. The child drops the events of the parent, that
+ *          the parent writes, and starts its own trace.
+ */
+///@{
+static void ForkPrepare(void) {
+
+    pthread_mutex_lock(&TraceLock);
+}
+
+static void ForkParent(void) {
+
+    pthread_mutex_unlock(&TraceLock);
+}
+
+static void ForkChild(void) {
+
+    TraceUsed = 0;
+    if( TraceFd >= 0 )
+        close(TraceFd);
+    Open(1);
+    TraceStart = Now();
+    pthread_mutex_unlock(&TraceLock);
+}
+///@}
+
+static void Init(void) {
+int expected = 0;
+
+    if( READY() || Inside )
+        return;
+    if( atomic_compare_exchange_strong(&TraceState,&expected,1) ) {
+        Inside = 1;
+        RealMalloc        = dlsym(RTLD_NEXT,"malloc");
+        RealFree          = dlsym(RTLD_NEXT,"free");
+        RealCalloc        = dlsym(RTLD_NEXT,"calloc");
+        RealRealloc       = dlsym(RTLD_NEXT,"realloc");
+        RealPosixMemalign = dlsym(RTLD_NEXT,"posix_memalign");
+        RealAlignedAlloc  = dlsym(RTLD_NEXT,"aligned_alloc");
+        RealMemalign      = dlsym(RTLD_NEXT,"memalign");
+        RealValloc        = dlsym(RTLD_NEXT,"valloc");
+        RealPvalloc       = dlsym(RTLD_NEXT,"pvalloc");
+
+        TraceFile = getenv("MEMTRACE_FILE");
+        Open(0);
+        TraceStart = Now();
+        Inside = 0;
+        atomic_store_explicit(&TraceState,2,memory_order_release);
+        /* It may allocate, so only when ready */
+        pthread_atfork(ForkPrepare,ForkParent,ForkChild);
+        return;
+    }
+    while( !READY() )
+        sched_yield();
+}
+
+/**
+ *  @brief  Write an event. size is ignored for a free
+ */
+static void Trace(char op, void *p, size_t size) {
+char line[96], *s;
+
+    if( Inside || !p || TraceFd < 0 )
+        return;
+    s = line;
+    *s++ = op;
+    *s++ = ' ';
+    s = Number(s,(uintptr_t) p);
+    *s++ = ' ';
+    if( op == 'a' ) {
+        s = Number(s,size);
+        *s++ = ' ';
+        *s++ = '0';
+        *s++ = ' ';
+    }
+    s = Number(s,Now()-TraceStart);
+    *s++ = '\n';
+
+    pthread_mutex_lock(&TraceLock);
+    if( TraceUsed+(s-line) > TRACEBUFFER )
+        Flush();
+    memcpy(TraceBuffer+TraceUsed,line,s-line);
+    TraceUsed += s-line;
+    pthread_mutex_unlock(&TraceLock);
+}
+
+__attribute__((destructor))
+static void Finish(void) {
+
+    pthread_mutex_lock(&TraceLock);
+    Flush();
+    pthread_mutex_unlock(&TraceLock);
+}
+
+void *malloc(size_t size) {
+void *p;
+
+    if( !READY() ) {
+        if( Inside )
+            return BootstrapAlloc(size);
+        Init();
+    }
+    p = RealMalloc(size);
+    Trace('a',p,size);
+    return p;
+}
+
+void free(void *p) {
+
+    if( !p || ISBOOTSTRAP(p) )
+        return;
+    if( !READY() )
+        Init();
+    Trace('f',p,0);
+    RealFree(p);
+}
+
+void *calloc(size_t n, size_t size) {
+void *p;
+
+    if( size && n > ~(size_t)0/size ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if( !READY() ) {
+        /* Static memory is already zeroed */
+        if( Inside )
+            return BootstrapAlloc(n*size);
+        Init();
+    }
+    p = RealCalloc(n,size);
+    Trace('a',p,n*size);
+    return p;
+}
+
+void *realloc(void *old, size_t size) {
+size_t left;
+void *p;
+
+    if( !READY() )
+        Init();
+    if( ISBOOTSTRAP(old) ) {
+        /* The old size is not known, the copy stops at the end of the buffer */
+        p = RealMalloc(size);
+        left = Bootstrap+BOOTSTRAPSIZE-(char *) old;
+        if( p )
+            memcpy(p,old,size < left ? size : left);
+        Trace('a',p,size);
+        return p;
+    }
+    Trace('f',old,0);
+    p = RealRealloc(old,size);
+    /* On failure the old block is still there */
+    Trace('a',p ? p : (size ? old : NULL),size);
+    return p;
+}
+
+int posix_memalign(void **pp, size_t align, size_t size) {
+int rc;
+
+    if( !READY() )
+        Init();
+    rc = RealPosixMemalign(pp,align,size);
+    if( rc == 0 )
+        Trace('a',*pp,size);
+    return rc;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+void *p;
+
+    if( !READY() )
+        Init();
+    p = RealAlignedAlloc(align,size);
+    Trace('a',p,size);
+    return p;
+}
+
+void *memalign(size_t align, size_t size) {
+void *p;
+
+    if( !READY() )
+        Init();
+    p = RealMemalign(align,size);
+    Trace('a',p,size);
+    return p;
+}
+
+void *valloc(size_t size) {
+void *p;
+
+    if( !READY() )
+        Init();
+    p = RealValloc(size);
+    Trace('a',p,size);
+    return p;
+}
+
+void *pvalloc(size_t size) {
+void *p;
+
+    if( !READY() )
+        Init();
+    p = RealPvalloc(size);
+    Trace('a',p,size);
+    return p;
+}